@@ -0,0 +1,664 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#if defined(__linux__) && !defined(NO_IO_URING)
+#define HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY    0
+#endif
+
+#include "aio.h"
+
+/* largest single read or write submitted */
+#define MAX_RW      (1u << 30)
+
+enum {
+    REQ_READ,
+    REQ_WRITE
+};
+
+enum {
+    ST_OPEN,
+    ST_STAT,
+    ST_RW,
+    ST_CLOSE
+};
+
+struct aio_req {
+    int         type;
+    int         state;
+    char        *path;
+    int         fd;
+    uint8_t     *data;
+    size_t      size;
+    size_t      done;
+    size_t      max_size;
+    size_t      slack;
+    /* read of size bytes at offset, instead of whole file */
+    bool        ranged;
+    uint64_t    offset;
+    int         error;
+    bool        complete;
+    aio_req     *next;
+#ifdef HAVE_IO_URING
+    struct statx stx;
+#endif
+};
+
+static int depth;
+static bool running;
+static aio_error_fn report_error;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+static int pending_writes;
+
+static pthread_t *threads;
+static int num_threads;
+
+static aio_req *queue_head;
+static aio_req *queue_tail;
+static bool stopping;
+
+/* read request that could not be allocated */
+static aio_req no_mem_req = { .error = ENOMEM, .complete = true };
+
+static aio_req *new_req(int type, const char *path)
+{
+    aio_req *req = calloc(1, sizeof(*req));
+    if (!req)
+        return NULL;
+    if (!(req->path = strdup(path))) {
+        free(req);
+        return NULL;
+    }
+    req->type = type;
+    req->fd = -1;
+    return req;
+}
+
+static void free_req(aio_req *req)
+{
+    if (req == &no_mem_req)
+        return;
+    free(req->path);
+    free(req->data);
+    free(req);
+}
+
+/*
+ * Called with lock held.
+ */
+static void complete_req(aio_req *req)
+{
+    if (req->type == REQ_WRITE) {
+        if (req->error && report_error)
+            report_error(req->path, req->error);
+        pending_writes--;
+        free_req(req);
+    } else {
+        req->complete = true;
+    }
+    pthread_cond_broadcast(&done_cond);
+}
+
+static int alloc_data(aio_req *req)
+{
+    if (req->size > req->max_size)
+        return EFBIG;
+    req->data = malloc(req->size + req->slack);
+    if (!req->data)
+        return ENOMEM;
+    memset(req->data + req->size, 0, req->slack);
+    return 0;
+}
+
+/*
+ * Blocking implementation, used by worker threads and with depth 0.
+ */
+static void run_sync(aio_req *req)
+{
+    int err = 0;
+
+    if (req->type == REQ_READ) {
+        struct stat st;
+        req->fd = open(req->path, O_RDONLY | O_BINARY);
+        if (req->fd < 0) {
+            err = errno;
+        } else if (req->ranged) {
+            if (lseek(req->fd, req->offset, SEEK_SET) < 0)
+                err = errno;
+        } else if (fstat(req->fd, &st)) {
+            err = errno;
+        } else {
+            req->size = st.st_size;
+            err = alloc_data(req);
+        }
+        while (!err && req->done < req->size) {
+            ssize_t n = read(req->fd, req->data + req->done, req->size - req->done);
+            if (n < 0 && errno != EINTR)
+                err = errno;
+            else if (n == 0 && req->ranged)
+                err = EIO;
+            else if (n == 0)
+                req->size = req->done;
+            else if (n > 0)
+                req->done += n;
+        }
+    } else {
+        req->fd = open(req->path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+        if (req->fd < 0)
+            err = errno;
+        while (!err && req->done < req->size) {
+            ssize_t n = write(req->fd, req->data + req->done, req->size - req->done);
+            if (n < 0 && errno != EINTR)
+                err = errno;
+            else if (n == 0)
+                err = EIO;
+            else if (n > 0)
+                req->done += n;
+        }
+    }
+
+    if (req->fd >= 0 && close(req->fd) && !err)
+        err = errno;
+    req->fd = -1;
+    req->error = err;
+}
+
+static void *worker_thread(void *arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&lock);
+    while (1) {
+        while (!queue_head && !stopping)
+            pthread_cond_wait(&queue_cond, &lock);
+        if (!queue_head)
+            break;
+        aio_req *req = queue_head;
+        queue_head = req->next;
+        if (!queue_head)
+            queue_tail = NULL;
+        pthread_mutex_unlock(&lock);
+
+        run_sync(req);
+
+        pthread_mutex_lock(&lock);
+        complete_req(req);
+    }
+    pthread_mutex_unlock(&lock);
+
+    return NULL;
+}
+
+#ifdef HAVE_IO_URING
+
+/*
+ * Single ring shared by submitting threads, which hold lock, and the
+ * completion thread, which alone consumes the completion queue.
+ */
+static struct {
+    int                 fd;
+    unsigned            *sq_tail, *sq_mask, *sq_array;
+    unsigned            *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void                *sq_ptr, *cq_ptr;
+    size_t              sq_len, cq_len, sqes_len;
+} ring = { .fd = -1 };
+
+static pthread_t reaper;
+
+static int uring_enter(unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    int ret;
+    do {
+        ret = syscall(__NR_io_uring_enter, ring.fd, to_submit, min_complete, flags, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+/*
+ * Called with lock held. Requests in flight are bounded by depth, and the
+ * ring is sized accordingly, so there is always a free entry. Returns 0 or
+ * errno value, when the entry is taken back unsubmitted.
+ */
+static int uring_submit(aio_req *req, struct io_uring_sqe *init)
+{
+    unsigned tail = *ring.sq_tail;
+    unsigned idx = tail & *ring.sq_mask;
+
+    ring.sqes[idx] = *init;
+    ring.sqes[idx].user_data = (uintptr_t)req;
+    ring.sq_array[idx] = idx;
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    if (uring_enter(1, 0, 0) < 0) {
+        int err = errno;
+        __atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+        return err;
+    }
+    return 0;
+}
+
+static void uring_next(aio_req *req)
+{
+    struct io_uring_sqe sqe = {};
+
+    switch (req->state) {
+    case ST_OPEN:
+        sqe.opcode = IORING_OP_OPENAT;
+        sqe.fd = AT_FDCWD;
+        sqe.addr = (uintptr_t)req->path;
+        sqe.open_flags = req->type == REQ_READ ? O_RDONLY : O_WRONLY | O_CREAT | O_TRUNC;
+        sqe.len = 0644;
+        break;
+    case ST_STAT:
+        sqe.opcode = IORING_OP_STATX;
+        sqe.fd = req->fd;
+        sqe.addr = (uintptr_t)"";
+        sqe.statx_flags = AT_EMPTY_PATH;
+        sqe.len = STATX_SIZE;
+        sqe.off = (uintptr_t)&req->stx;
+        break;
+    case ST_RW:
+        sqe.opcode = req->type == REQ_READ ? IORING_OP_READ : IORING_OP_WRITE;
+        sqe.fd = req->fd;
+        sqe.addr = (uintptr_t)(req->data + req->done);
+        sqe.len = req->size - req->done > MAX_RW ? MAX_RW : req->size - req->done;
+        sqe.off = req->offset + req->done;
+        break;
+    case ST_CLOSE:
+        sqe.opcode = IORING_OP_CLOSE;
+        sqe.fd = req->fd;
+        break;
+    }
+
+    /* request fails with the error, its file is closed right away */
+    int err = uring_submit(req, &sqe);
+    if (err) {
+        if (!req->error)
+            req->error = err;
+        if (req->fd >= 0)
+            close(req->fd);
+        req->fd = -1;
+        complete_req(req);
+    }
+}
+
+/*
+ * Advance request state machine on completion of its last operation.
+ * Called with lock held.
+ */
+static void uring_complete(aio_req *req, int res)
+{
+    int state = req->state;
+
+    if (res < 0 && state != ST_CLOSE) {
+        req->error = -res;
+        req->state = req->fd >= 0 ? ST_CLOSE : -1;
+    } else {
+        switch (state) {
+        case ST_OPEN:
+            req->fd = res;
+            req->state = req->type == REQ_READ && !req->ranged ? ST_STAT : ST_RW;
+            break;
+        case ST_STAT:
+            req->size = req->stx.stx_size;
+            req->error = alloc_data(req);
+            req->state = ST_RW;
+            break;
+        case ST_RW:
+            if (res == 0 && req->type == REQ_READ && !req->ranged)
+                req->size = req->done;
+            else if (res == 0)
+                req->error = EIO;
+            req->done += res;
+            break;
+        case ST_CLOSE:
+            if (res < 0 && !req->error)
+                req->error = -res;
+            req->fd = -1;
+            req->state = -1;
+            break;
+        }
+        if (req->state == ST_RW && (req->error || req->done == req->size))
+            req->state = ST_CLOSE;
+    }
+
+    if (req->state == -1)
+        complete_req(req);
+    else
+        uring_next(req);
+}
+
+static void *reaper_thread(void *arg)
+{
+    (void)arg;
+
+    while (1) {
+        /*
+         * Waiting fails when the kernel is short of resources, which
+         * completions reaped meanwhile give back.
+         */
+        if (uring_enter(0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+            *ring.cq_head == __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE))
+            usleep(1000);
+
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        bool stop = false;
+
+        pthread_mutex_lock(&lock);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            if (cqe->user_data)
+                uring_complete((aio_req *)(uintptr_t)cqe->user_data, cqe->res);
+            else
+                stop = true;
+        }
+        pthread_mutex_unlock(&lock);
+
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+        if (stop)
+            break;
+    }
+
+    return NULL;
+}
+
+static bool uring_probe(void)
+{
+    static const int ops[] = {
+        IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE
+    };
+    size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *p = calloc(1, len);
+    bool ok = p && !syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PROBE, p, 256);
+
+    for (int i = 0; ok && i < sizeof(ops) / sizeof(ops[0]); i++)
+        ok = ops[i] <= p->last_op && (p->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+
+    free(p);
+    return ok;
+}
+
+static void uring_free(void)
+{
+    if (ring.sq_ptr && ring.sq_ptr != MAP_FAILED)
+        munmap(ring.sq_ptr, ring.sq_len);
+    if (ring.cq_ptr && ring.cq_ptr != ring.sq_ptr && ring.cq_ptr != MAP_FAILED)
+        munmap(ring.cq_ptr, ring.cq_len);
+    if (ring.sqes && ring.sqes != MAP_FAILED)
+        munmap(ring.sqes, ring.sqes_len);
+    if (ring.fd >= 0)
+        close(ring.fd);
+    memset(&ring, 0, sizeof(ring));
+    ring.fd = -1;
+}
+
+static bool uring_init(void)
+{
+    struct io_uring_params p = {};
+
+    /* one operation per pending read and write, plus shutdown */
+    ring.fd = syscall(__NR_io_uring_setup, 2 * depth + 1, &p);
+    if (ring.fd < 0)
+        return false;
+
+    ring.sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring.cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        ring.sq_len = ring.cq_len = ring.sq_len > ring.cq_len ? ring.sq_len : ring.cq_len;
+
+    ring.sq_ptr = mmap(NULL, ring.sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring.fd, IORING_OFF_SQ_RING);
+    if (ring.sq_ptr == MAP_FAILED)
+        goto fail;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        ring.cq_ptr = ring.sq_ptr;
+    else
+        ring.cq_ptr = mmap(NULL, ring.cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           ring.fd, IORING_OFF_CQ_RING);
+    if (ring.cq_ptr == MAP_FAILED)
+        goto fail;
+
+    ring.sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring.sqes = mmap(NULL, ring.sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     ring.fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED)
+        goto fail;
+
+    ring.sq_tail  = (unsigned *)((uint8_t *)ring.sq_ptr + p.sq_off.tail);
+    ring.sq_mask  = (unsigned *)((uint8_t *)ring.sq_ptr + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned *)((uint8_t *)ring.sq_ptr + p.sq_off.array);
+    ring.cq_head  = (unsigned *)((uint8_t *)ring.cq_ptr + p.cq_off.head);
+    ring.cq_tail  = (unsigned *)((uint8_t *)ring.cq_ptr + p.cq_off.tail);
+    ring.cq_mask  = (unsigned *)((uint8_t *)ring.cq_ptr + p.cq_off.ring_mask);
+    ring.cqes     = (struct io_uring_cqe *)((uint8_t *)ring.cq_ptr + p.cq_off.cqes);
+
+    if (!uring_probe() || pthread_create(&reaper, NULL, reaper_thread, NULL))
+        goto fail;
+
+    return true;
+
+fail:
+    uring_free();
+    return false;
+}
+
+static void uring_finish(void)
+{
+    struct io_uring_sqe sqe = { .opcode = IORING_OP_NOP };
+    int err;
+
+    for (int i = 0; i < 1000; i++) {
+        pthread_mutex_lock(&lock);
+        err = uring_submit(NULL, &sqe);
+        pthread_mutex_unlock(&lock);
+        if (!err)
+            break;
+        usleep(1000);
+    }
+
+    /* nothing is in flight, but the reaper can't be stopped, so it is left */
+    if (err) {
+        pthread_detach(reaper);
+        return;
+    }
+
+    pthread_join(reaper, NULL);
+    uring_free();
+}
+
+#endif
+
+static void start_req(aio_req *req)
+{
+    if (!depth) {
+        run_sync(req);
+        complete_req(req);
+        return;
+    }
+
+#ifdef HAVE_IO_URING
+    if (ring.fd >= 0) {
+        req->state = ST_OPEN;
+        uring_next(req);
+        return;
+    }
+#endif
+
+    if (queue_tail)
+        queue_tail->next = req;
+    else
+        queue_head = req;
+    queue_tail = req;
+    pthread_cond_signal(&queue_cond);
+}
+
+void aio_init(int d, aio_error_fn error_fn)
+{
+    depth = d;
+    report_error = error_fn;
+    running = true;
+
+    if (!depth)
+        return;
+
+#ifdef HAVE_IO_URING
+    if (uring_init())
+        return;
+#endif
+
+    /* each thread serves one read or write at a time */
+    threads = malloc(2 * depth * sizeof(pthread_t));
+    for (num_threads = 0; threads && num_threads < 2 * depth; num_threads++)
+        if (pthread_create(&threads[num_threads], NULL, worker_thread, NULL))
+            break;
+
+    /* without threads, I/O is done synchronously */
+    if (!num_threads)
+        depth = 0;
+}
+
+void aio_sync(void)
+{
+    pthread_mutex_lock(&lock);
+    while (pending_writes)
+        pthread_cond_wait(&done_cond, &lock);
+    pthread_mutex_unlock(&lock);
+}
+
+void aio_finish(void)
+{
+    if (!running)
+        return;
+
+    pthread_mutex_lock(&lock);
+    while (pending_writes)
+        pthread_cond_wait(&done_cond, &lock);
+    stopping = true;
+    pthread_cond_broadcast(&queue_cond);
+    pthread_mutex_unlock(&lock);
+
+#ifdef HAVE_IO_URING
+    if (ring.fd >= 0)
+        uring_finish();
+#endif
+
+    for (int i = 0; i < num_threads; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    threads = NULL;
+    num_threads = 0;
+
+    running = false;
+}
+
+const char *aio_backend(void)
+{
+    if (!depth)
+        return "sync";
+#ifdef HAVE_IO_URING
+    if (ring.fd >= 0)
+        return "io_uring";
+#endif
+    return "threads";
+}
+
+aio_req *aio_read(const char *path, size_t max_size, size_t slack)
+{
+    aio_req *req = new_req(REQ_READ, path);
+    if (!req)
+        return &no_mem_req;
+    req->max_size = max_size;
+    req->slack = slack;
+
+    pthread_mutex_lock(&lock);
+    start_req(req);
+    pthread_mutex_unlock(&lock);
+
+    return req;
+}
+
+aio_req *aio_read_range(const char *path, uint64_t offset, size_t size, size_t max_size, size_t slack)
+{
+    aio_req *req = new_req(REQ_READ, path);
+    if (!req)
+        return &no_mem_req;
+    req->max_size = max_size;
+    req->slack = slack;
+    req->ranged = true;
+    req->offset = offset;
+    req->size = size;
+
+    pthread_mutex_lock(&lock);
+    if ((req->error = alloc_data(req)))
+        complete_req(req);
+    else
+        start_req(req);
+    pthread_mutex_unlock(&lock);
+
+    return req;
+}
+
+int aio_read_wait(aio_req *req, uint8_t **data, size_t *size)
+{
+    pthread_mutex_lock(&lock);
+    while (!req->complete)
+        pthread_cond_wait(&done_cond, &lock);
+    pthread_mutex_unlock(&lock);
+
+    int err = req->error;
+    if (!err) {
+        *data = req->data;
+        *size = req->size;
+        req->data = NULL;
+    }
+    free_req(req);
+
+    return err;
+}
+
+void aio_write(const char *path, uint8_t *data, size_t size)
+{
+    aio_req *req = new_req(REQ_WRITE, path);
+    if (!req) {
+        free(data);
+        if (report_error)
+            report_error(path, ENOMEM);
+        return;
+    }
+    req->data = data;
+    req->size = size;
+
+    pthread_mutex_lock(&lock);
+    while (depth && pending_writes >= depth)
+        pthread_cond_wait(&done_cond, &lock);
+    pending_writes++;
+    start_req(req);
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,56 @@
+#ifndef AIO_H
+#define AIO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct aio_req aio_req;
+
+typedef void (*aio_error_fn)(const char *path, int err);
+
+/*
+ * Start I/O backend allowing depth requests of each kind in flight. Depth
+ * 0 performs all I/O synchronously in the calling thread, as does any
+ * depth if no I/O thread can be started. Failed writes are reported
+ * through error_fn from the I/O thread.
+ */
+void aio_init(int depth, aio_error_fn error_fn);
+
+/*
+ * Wait for all queued writes and stop the backend. Safe to call more than
+ * once.
+ */
+void aio_finish(void);
+
+/*
+ * Wait for all queued writes to complete.
+ */
+void aio_sync(void);
+
+const char *aio_backend(void);
+
+/*
+ * Start reading whole file into a buffer with slack zeroed bytes past the
+ * end. Files bigger than max_size fail with EFBIG.
+ */
+aio_req *aio_read(const char *path, size_t max_size, size_t slack);
+
+/*
+ * Start reading size bytes at offset of file, which fail with EIO if the
+ * file ends before.
+ */
+aio_req *aio_read_range(const char *path, uint64_t offset, size_t size, size_t max_size, size_t slack);
+
+/*
+ * Wait for read to complete and release request. Returns 0 and buffer,
+ * which caller must free, or errno value.
+ */
+int aio_read_wait(aio_req *req, uint8_t **data, size_t *size);
+
+/*
+ * Queue writing size bytes of data to path. Takes ownership of data,
+ * which must come from malloc(). Blocks while depth writes are pending.
+ */
+void aio_write(const char *path, uint8_t *data, size_t size);
+
+#endif
@@ -0,0 +1,543 @@
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <ctype.h>
+#include <limits.h>
+
+#include <zlib.h>
+
+#include "archive.h"
+
+#ifdef _WIN32
+#define fseeko      _fseeki64
+#define ftello      _ftelli64
+#endif
+
+#define MIN(a, b)   ((a) < (b) ? (a) : (b))
+
+/* largest long name or pax header read */
+#define MAX_META    (1 << 20)
+
+#define ZIP_LOCAL       0x04034b50
+#define ZIP_CENTRAL     0x02014b50
+#define ZIP_END         0x06054b50
+#define ZIP64_END       0x06064b50
+#define ZIP64_LOCATOR   0x07064b50
+
+/* end of central directory is followed by a comment of up to 64 KiB */
+#define ZIP_END_SIZE    22
+#define ZIP_TAIL_SIZE   (ZIP_END_SIZE + 0xffff)
+
+typedef struct {
+    arc_member  *members;
+    int         num_members;
+    int         max_members;
+} list_t;
+
+static int add_member(list_t *l, const arc_member *m)
+{
+    if (l->num_members == l->max_members) {
+        int max = l->max_members ? 2 * l->max_members : 256;
+        arc_member *members = realloc(l->members, max * sizeof(arc_member));
+        if (!members)
+            return ENOMEM;
+        l->members = members;
+        l->max_members = max;
+    }
+    l->members[l->num_members++] = *m;
+    return 0;
+}
+
+static uint16_t get16(const uint8_t *p)
+{
+    return p[0] | p[1] << 8;
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+    return get16(p) | (uint32_t)get16(p + 2) << 16;
+}
+
+static uint64_t get64(const uint8_t *p)
+{
+    return get32(p) | (uint64_t)get32(p + 4) << 32;
+}
+
+static char *copy_string(const void *s, size_t n)
+{
+    char *p = malloc(n + 1);
+    if (p) {
+        memcpy(p, s, n);
+        p[n] = 0;
+    }
+    return p;
+}
+
+static bool has_ext(const char *path, const char *ext)
+{
+    size_t n = strlen(path), k = strlen(ext);
+    if (n < k)
+        return false;
+    for (size_t i = 0; i < k; i++)
+        if (tolower((unsigned char)path[n - k + i]) != ext[i])
+            return false;
+    return true;
+}
+
+bool arc_is_archive(const char *path)
+{
+    return has_ext(path, ".tar") || has_ext(path, ".zip");
+}
+
+static int read_at(FILE *fp, uint64_t offset, void *buf, size_t size)
+{
+    if (fseeko(fp, offset, SEEK_SET))
+        return errno;
+    if (fread(buf, 1, size, fp) != size)
+        return ferror(fp) ? EIO : EINVAL;
+    return 0;
+}
+
+/*
+ * Octal number, or base-256 with the top bit of the first byte set.
+ */
+static uint64_t tar_number(const uint8_t *p, int n)
+{
+    uint64_t v = 0;
+    int i = 0;
+
+    if (*p & 0x80) {
+        v = *p & 0x7f;
+        for (i = 1; i < n; i++)
+            v = v << 8 | p[i];
+        return v;
+    }
+
+    while (i < n && p[i] == ' ')
+        i++;
+    for (; i < n && p[i] >= '0' && p[i] <= '7'; i++)
+        v = v << 3 | (p[i] - '0');
+    return v;
+}
+
+static bool tar_checksum_ok(const uint8_t *h)
+{
+    unsigned sum = 0;
+
+    for (int i = 0; i < 512; i++)
+        sum += i >= 148 && i < 156 ? ' ' : h[i];
+    return sum == tar_number(h + 148, 8);
+}
+
+/*
+ * Name of ustar header, joined with its prefix.
+ */
+static char *tar_name(const uint8_t *h)
+{
+    const char *name = (const char *)h, *prefix = (const char *)h + 345;
+    size_t n = strnlen(name, 100);
+    size_t k = memcmp(h + 257, "ustar", 5) ? 0 : strnlen(prefix, 155);
+
+    char *s = malloc(k + 1 + n + 1);
+    if (s) {
+        memcpy(s, prefix, k);
+        if (k)
+            s[k++] = '/';
+        memcpy(s + k, name, n);
+        s[k + n] = 0;
+    }
+    return s;
+}
+
+/*
+ * Take path and size from records "<length> <key>=<value>\n" of a pax
+ * header.
+ */
+static int parse_pax(const char *p, size_t n, char **path, uint64_t *size, bool *has_size)
+{
+    const char *end = p + n;
+
+    while (p < end) {
+        char *q;
+        unsigned long len = strtoul(p, &q, 10);
+        if (*q != ' ' || len <= q + 1 - p || len > end - p || p[len - 1] != '\n')
+            return EINVAL;
+        const char *key = q + 1, *rec_end = p + len - 1;
+        const char *eq = memchr(key, '=', rec_end - key);
+        if (!eq)
+            return EINVAL;
+
+        if (eq - key == 4 && !memcmp(key, "path", 4)) {
+            char *s = copy_string(eq + 1, rec_end - eq - 1);
+            if (!s)
+                return ENOMEM;
+            free(*path);
+            *path = s;
+        } else if (eq - key == 4 && !memcmp(key, "size", 4)) {
+            *size = strtoull(eq + 1, NULL, 10);
+            *has_size = true;
+        }
+
+        p += len;
+    }
+
+    return 0;
+}
+
+static int list_tar(FILE *fp, list_t *l)
+{
+    uint8_t h[512];
+    uint64_t pos = 0;
+    char *long_name = NULL;
+    uint64_t pax_size = 0;
+    bool has_pax_size = false;
+    int err = 0;
+
+    while (!err) {
+        size_t n = fread(h, 1, sizeof(h), fp);
+        /* archives cut after the last member still list */
+        if (!n && !ferror(fp))
+            break;
+        if (n != sizeof(h)) {
+            err = ferror(fp) ? EIO : EINVAL;
+            break;
+        }
+
+        bool zero = true;
+        for (int i = 0; i < sizeof(h) && zero; i++)
+            zero = !h[i];
+        if (zero)
+            break;
+        if (!tar_checksum_ok(h)) {
+            err = EINVAL;
+            break;
+        }
+
+        uint64_t data = pos + sizeof(h);
+        uint64_t size = tar_number(h + 124, 12);
+        int type = h[156];
+
+        if (type == 'L' || type == 'x') {
+            char *meta;
+            if (size > MAX_META) {
+                err = EINVAL;
+            } else if (!(meta = malloc(size + 1))) {
+                err = ENOMEM;
+            } else if (fread(meta, 1, size, fp) != size) {
+                err = ferror(fp) ? EIO : EINVAL;
+                free(meta);
+            } else if (type == 'L') {
+                meta[size] = 0;
+                free(long_name);
+                long_name = meta;
+            } else {
+                meta[size] = 0;
+                err = parse_pax(meta, size, &long_name, &pax_size, &has_pax_size);
+                free(meta);
+            }
+        } else if (type != 'K' && type != 'g') {
+            /* long names and pax values are for this header only */
+            if (has_pax_size)
+                size = pax_size;
+
+            if (type == '0' || type == '7' || !type) {
+                arc_member m = { .offset = data, .size = size, .length = size };
+                m.name = long_name ? long_name : tar_name(h);
+                long_name = NULL;
+                if (!m.name)
+                    err = ENOMEM;
+                else if ((err = add_member(l, &m)))
+                    free(m.name);
+            }
+
+            free(long_name);
+            long_name = NULL;
+            has_pax_size = false;
+        }
+
+        pos = data + ((size + 511) & ~(uint64_t)511);
+        if (!err && fseeko(fp, pos, SEEK_SET))
+            err = errno;
+    }
+
+    free(long_name);
+    return err;
+}
+
+static int compare_offsets(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Zip members are read from their local header up to the next local
+ * header or the central directory, which covers any data descriptor.
+ */
+static void set_zip_sizes(list_t *l, uint64_t *offsets, int num_offsets, uint64_t cd_offset)
+{
+    qsort(offsets, num_offsets, sizeof(uint64_t), compare_offsets);
+
+    for (int i = 0; i < l->num_members; i++) {
+        arc_member *m = &l->members[i];
+        int lo = 0, hi = num_offsets;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (offsets[mid] <= m->offset)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        uint64_t end = lo < num_offsets ? MIN(offsets[lo], cd_offset) : cd_offset;
+        m->size = end > m->offset ? end - m->offset : 0;
+    }
+}
+
+static int parse_central(const uint8_t *cd, uint64_t cd_size, uint64_t entries, uint64_t cd_offset, list_t *l)
+{
+    uint64_t *offsets = malloc((MIN(entries, cd_size / 46) + 1) * sizeof(uint64_t));
+    int num_offsets = 0;
+    uint64_t p = 0;
+    int err = 0;
+
+    if (!offsets)
+        return ENOMEM;
+
+    for (uint64_t k = 0; k < entries && !err; k++) {
+        const uint8_t *e = cd + p;
+        if (p + 46 > cd_size || get32(e) != ZIP_CENTRAL) {
+            err = EINVAL;
+            break;
+        }
+
+        int flags = get16(e + 8);
+        int method = get16(e + 10);
+        uint64_t csize = get32(e + 20);
+        uint64_t length = get32(e + 24);
+        int n = get16(e + 28), x = get16(e + 30), c = get16(e + 32);
+        uint64_t offset = get32(e + 42);
+        if (p + 46 + n + x + c > cd_size) {
+            err = EINVAL;
+            break;
+        }
+
+        /* zip64 sizes and offset follow in this order, where the field is full */
+        for (const uint8_t *q = e + 46 + n, *end = q + x; q + 4 <= end; q += 4 + get16(q + 2)) {
+            const uint8_t *v = q + 4, *v_end = MIN(v + get16(q + 2), end);
+            if (get16(q) != 1)
+                continue;
+            if (length == 0xffffffff && v + 8 <= v_end)
+                length = get64(v), v += 8;
+            if (csize == 0xffffffff && v + 8 <= v_end)
+                csize = get64(v), v += 8;
+            if (offset == 0xffffffff && v + 8 <= v_end)
+                offset = get64(v);
+        }
+
+        offsets[num_offsets++] = offset;
+        p += 46 + n + x + c;
+
+        if (!n || e[46 + n - 1] == '/')
+            continue;
+
+        arc_member m = {
+            .name   = copy_string(e + 46, n),
+            .offset = offset,
+            .length = length,
+            .zip    = true,
+            .method = flags & 1 ? -1 : method,
+            .csize  = csize,
+            .crc    = get32(e + 16),
+        };
+        if (!m.name)
+            err = ENOMEM;
+        else if ((err = add_member(l, &m)))
+            free(m.name);
+    }
+
+    if (!err)
+        set_zip_sizes(l, offsets, num_offsets, cd_offset);
+    free(offsets);
+    return err;
+}
+
+static int list_zip(FILE *fp, list_t *l)
+{
+    if (fseeko(fp, 0, SEEK_END))
+        return errno;
+    int64_t file_size = ftello(fp);
+    if (file_size < ZIP_END_SIZE)
+        return EINVAL;
+
+    size_t tail_size = MIN(file_size, ZIP_TAIL_SIZE);
+    uint64_t tail_pos = file_size - tail_size;
+    uint8_t *tail = malloc(tail_size);
+    if (!tail)
+        return ENOMEM;
+    int err = read_at(fp, tail_pos, tail, tail_size);
+
+    ptrdiff_t i = tail_size - ZIP_END_SIZE;
+    while (!err && i >= 0 && get32(tail + i) != ZIP_END)
+        i--;
+    if (!err && i < 0)
+        err = EINVAL;
+
+    uint64_t entries = 0, cd_size = 0, cd_offset = 0;
+    if (!err) {
+        entries = get16(tail + i + 10);
+        cd_size = get32(tail + i + 12);
+        cd_offset = get32(tail + i + 16);
+    }
+
+    /* zip64 end record, found through the locator before the end record */
+    if (!err && (entries == 0xffff || cd_size == 0xffffffff || cd_offset == 0xffffffff)) {
+        uint8_t loc[20], end[56];
+        if (tail_pos + i < sizeof(loc))
+            err = EINVAL;
+        else if (!(err = read_at(fp, tail_pos + i - sizeof(loc), loc, sizeof(loc))) &&
+                 get32(loc) != ZIP64_LOCATOR)
+            err = EINVAL;
+        else if (!err && !(err = read_at(fp, get64(loc + 8), end, sizeof(end))) &&
+                 get32(end) != ZIP64_END)
+            err = EINVAL;
+        if (!err) {
+            entries = get64(end + 32);
+            cd_size = get64(end + 40);
+            cd_offset = get64(end + 48);
+        }
+    }
+    free(tail);
+
+    if (!err && (cd_offset > file_size || cd_size > file_size - cd_offset))
+        err = EINVAL;
+    if (err)
+        return err;
+
+    uint8_t *cd = malloc(cd_size + 1);
+    if (!cd)
+        return ENOMEM;
+    err = read_at(fp, cd_offset, cd, cd_size);
+    if (!err)
+        err = parse_central(cd, cd_size, entries, cd_offset, l);
+    free(cd);
+
+    return err;
+}
+
+int arc_list(const char *path, arc_member **members, int *num_members)
+{
+    list_t l = {};
+
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+        return errno;
+
+    int err = has_ext(path, ".zip") ? list_zip(fp, &l) : list_tar(fp, &l);
+    fclose(fp);
+
+    if (err) {
+        arc_free(l.members, l.num_members);
+        return err;
+    }
+
+    *members = l.members;
+    *num_members = l.num_members;
+    return 0;
+}
+
+void arc_free(arc_member *members, int num_members)
+{
+    for (int i = 0; i < num_members; i++)
+        free(members[i].name);
+    free(members);
+}
+
+int arc_stored_offset(const char *path, const arc_member *m, uint64_t *offset)
+{
+    if (!m->zip) {
+        *offset = m->offset;
+        return 0;
+    }
+    if (m->method != 0)
+        return ENOTSUP;
+
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+        return errno;
+
+    uint8_t hdr[30];
+    int err = read_at(fp, m->offset, hdr, sizeof(hdr));
+    fclose(fp);
+    if (!err && get32(hdr) != ZIP_LOCAL)
+        err = EINVAL;
+    if (!err)
+        *offset = m->offset + sizeof(hdr) + get16(hdr + 26) + get16(hdr + 28);
+
+    return err;
+}
+
+static int inflate_member(const uint8_t *in, const arc_member *m, uint8_t *out)
+{
+    z_stream z = {};
+
+    if (inflateInit2(&z, -MAX_WBITS) != Z_OK)
+        return ENOMEM;
+    z.next_in = (uint8_t *)in;
+    z.avail_in = m->csize;
+    z.next_out = out;
+    z.avail_out = m->length;
+    int res = inflate(&z, Z_FINISH);
+    inflateEnd(&z);
+
+    return res == Z_STREAM_END && z.total_out == m->length ? 0 : EINVAL;
+}
+
+int arc_extract(const arc_member *m, uint8_t **data, size_t *size, size_t max_size, size_t slack)
+{
+    uint8_t *in = *data, *out = in;
+    int err = 0;
+
+    if (m->length > max_size || m->length > UINT_MAX || m->csize > UINT_MAX) {
+        free(in);
+        return EFBIG;
+    }
+
+    if (!m->zip)
+        return 0;
+
+    size_t hdr = 30;
+    if (*size < hdr || get32(in) != ZIP_LOCAL)
+        err = EINVAL;
+    else if ((hdr += get16(in + 26) + get16(in + 28)) > *size || m->csize > *size - hdr)
+        err = EINVAL;
+    else if (m->method == 0 && m->csize != m->length)
+        err = EINVAL;
+    else if (m->method == 0)
+        memmove(out, in + hdr, m->length);
+    else if (m->method != 8)
+        err = ENOTSUP;
+    else if (!(out = malloc(m->length + slack)))
+        err = ENOMEM;
+    else
+        err = inflate_member(in + hdr, m, out);
+
+    if (!err && crc32(0, out, m->length) != m->crc)
+        err = EINVAL;
+
+    if (out != in)
+        free(err ? out : in);
+    if (err) {
+        free(in);
+        return err;
+    }
+
+    memset(out + m->length, 0, slack);
+    *data = out;
+    *size = m->length;
+    return 0;
+}
@@ -0,0 +1,50 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Regular file in an archive. Its data is read as size bytes at offset
+ * of the archive, which arc_extract() turns into the contents. Zip
+ * members are read with their local header, and may be deflated.
+ */
+typedef struct {
+    char        *name;
+    uint64_t    offset;
+    uint64_t    size;
+    uint64_t    length;
+    bool        zip;
+    int         method;
+    uint64_t    csize;
+    uint32_t    crc;
+} arc_member;
+
+/*
+ * Whether path names a tar or zip file, by its extension.
+ */
+bool arc_is_archive(const char *path);
+
+/*
+ * List regular files in uncompressed tar or in zip file, in archive
+ * order. Returns 0 or errno value, EINVAL for a bad archive.
+ */
+int arc_list(const char *path, arc_member **members, int *num_members);
+
+void arc_free(arc_member *members, int num_members);
+
+/*
+ * Offset of the contents of member in archive path, if they are stored
+ * as is. Returns 0 or errno value, ENOTSUP for compressed members.
+ */
+int arc_stored_offset(const char *path, const arc_member *m, uint64_t *offset);
+
+/*
+ * Turn data read for member, which is taken over, into its contents with
+ * slack zeroed bytes past the end. Returns 0 or errno value, EFBIG for
+ * contents bigger than max_size.
+ */
+int arc_extract(const arc_member *m, uint8_t **data, size_t *size, size_t max_size, size_t slack);
+
+#endif
@@ -0,0 +1,216 @@
+#ifndef LIBSGD_H
+#define LIBSGD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Functions returning int give 0 on success or a negative errno value:
+ * -ENOMEM, -EFBIG for files or images over the size limit, -EINVAL for bad
+ * SGD data, or the error of a failed read or sink call. sgd_last_error()
+ * then describes the failure. Memory and images held by a failed call are
+ * released, and the file can still be used.
+ *
+ * An sgd_file may be used by one thread at a time. Different files can
+ * be converted in parallel.
+ */
+
+/*
+ * Buffers passed to sgd_open_owned() have this many bytes allocated past
+ * the end of data.
+ */
+#define SGD_SLACK   4096
+
+typedef struct sgd_file sgd_file;
+
+typedef struct {
+    uint8_t     r, g, b;
+} sgd_color;
+
+typedef struct {
+    /* limit for decompressed SGD data and for image size in pixels */
+    size_t      max_size;
+    /* zlib compression level of PNG images, -1 for default */
+    int         compression;
+    /* 16 colors, the upper 8 for highlighted pixels, NULL for default */
+    const sgd_color *palette;
+
+    /* process image in strips of one tile row */
+    int         stream;
+    /* threads rendering and encoding selection sets */
+    int         jobs;
+    /*
+     * threads encoding base and set images while rendering goes on, 0 to
+     * encode in rendering threads
+     */
+    int         encoders;
+
+    /* outputs of sgd_convert() */
+    int         base_image;
+    int         full_images;
+    int         crop_images;
+    /* 16 bit map of set groups, see sgd_convert() */
+    int         set_map;
+    int         levels;
+    int         tile_size;
+
+    /* names of selection sets to process, with * and ? wildcards */
+    const char * const *sets;
+    int         num_sets;
+
+    /* receives statistics, may be NULL */
+    void        (*log)(void *opaque, const char *msg);
+    void        *log_opaque;
+} sgd_options;
+
+/*
+ * Output of sgd_convert(). Names are <name>.png, <name>_2.png,
+ * <name>/<z>/<x>/<y>.png, <name>_sets.png, and full/<base>_<set>.png and
+ * crop/<base>_<set>.png in the directory part of name, where base is the
+ * rest of it. Pixels of the set map are one plus the index of the last
+ * group covering them, or zero. Calls are serialised.
+ */
+typedef struct {
+    /* Store PNG data, taking ownership of it. Returns 0 or errno. */
+    int         (*write)(void *opaque, const char *name, uint8_t *data, size_t size);
+    /*
+     * Store name as a copy of target, which was written before. Returns 0
+     * or errno. When NULL, data is written again.
+     */
+    int         (*link)(void *opaque, const char *name, const char *target);
+    void        *opaque;
+} sgd_sink;
+
+/*
+ * Selection set group: top-level sets of one name. Bounds are those of
+ * the cropped image, with exclusive x1 and y1, and all zero if there is
+ * none or crop_images is not set in options. Set bounds are those of the
+ * sets themselves, which the crop adds a margin of up to 75 pixels to, or
+ * falls back to a label area for, and likewise zero if there are none.
+ */
+typedef struct {
+    char        name[16];
+    int         num_members;
+    int         num_entries;
+    int         x0, y0, x1, y1;
+    int         set_x0, set_y0, set_x1, set_y1;
+} sgd_set_info;
+
+/*
+ * Size and work of a file with the options it was opened with. Pixels are
+ * those composed for the base image and encoded for set images. Times are
+ * those of the last sgd_convert(), in seconds.
+ */
+typedef struct {
+    int         width, height;
+    int         num_tiles;
+    int         num_entries;
+    int         num_sets;
+    double      base_pixels;
+    double      set_pixels;
+    double      base_time;
+    double      set_time;
+} sgd_stats;
+
+/*
+ * Big buffers, mask surfaces and PNG encoder state released by any file
+ * are pooled and reused by later ones, up to a limit of 512 MiB unless set
+ * otherwise. Requests count those big enough to be pooled, hits those
+ * served from the pool, and held is the size of buffers kept unused.
+ */
+typedef struct {
+    size_t      requests;
+    size_t      hits;
+    size_t      held;
+} sgd_pool_stats;
+
+void sgd_default_options(sgd_options *opt);
+
+/*
+ * Open SGD or gzip compressed SGD data. Options are copied, except for
+ * palette and set names, which must stay valid until sgd_close().
+ */
+int sgd_open_memory(sgd_file **f, const void *data, size_t size, const sgd_options *opt);
+
+/*
+ * Like sgd_open_memory(), but takes ownership of data, which must come
+ * from malloc() with SGD_SLACK bytes allocated past size.
+ */
+int sgd_open_owned(sgd_file **f, void *data, size_t size, const sgd_options *opt);
+
+int sgd_open_path(sgd_file **f, const char *path, const sgd_options *opt);
+
+/*
+ * Open SGD or gzip compressed SGD data stored as size bytes at offset of
+ * file path for sgd_get_stats(), sgd_num_sets() and sgd_get_set() only.
+ * Just the header, directory and entries are read, and compressed data
+ * is inflated only as far as they reach. Image data is not read.
+ */
+int sgd_scan_path(sgd_file **f, const char *path, uint64_t offset, uint64_t size, const sgd_options *opt);
+
+void sgd_close(sgd_file *f);
+
+/*
+ * Message for the last failure in calling thread.
+ */
+const char *sgd_last_error(void);
+
+void sgd_get_size(const sgd_file *f, int *width, int *height);
+
+/*
+ * Estimate of the most memory sgd_convert() holds at once with the
+ * options given, file data included.
+ */
+size_t sgd_estimate_memory(const sgd_file *f);
+
+/*
+ * Most memory held at once by the last sgd_convert(), or since opening.
+ */
+size_t sgd_peak_memory(const sgd_file *f);
+
+void sgd_get_stats(const sgd_file *f, sgd_stats *stats);
+
+void sgd_get_pool_stats(sgd_pool_stats *stats);
+
+/*
+ * Release buffers kept in the pool. Buffers in use are pooled again when
+ * released.
+ */
+void sgd_free_pool(void);
+
+/*
+ * Set most memory held by the pool, dropping the biggest buffers to fit.
+ */
+void sgd_set_pool_limit(size_t size);
+
+int sgd_num_sets(const sgd_file *f);
+
+int sgd_get_set(const sgd_file *f, int index, sgd_set_info *info);
+
+/*
+ * Render base image as palette indices to buf, which holds width * height
+ * bytes.
+ */
+int sgd_render_base(sgd_file *f, uint8_t *buf);
+
+/*
+ * Render image of a selection set group to buf, which holds width *
+ * height bytes of the full image, or of the crop when crop is nonzero,
+ * which needs crop_images in options.
+ */
+int sgd_render_set(sgd_file *f, int index, int crop, uint8_t *buf);
+
+/*
+ * Write PNG images selected in options to sink, named after name.
+ */
+int sgd_convert(sgd_file *f, const char *name, const sgd_sink *sink);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
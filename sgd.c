@@ -1,3 +1,5 @@
+#define _FILE_OFFSET_BITS 64
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,47 +8,173 @@
 #include <errno.h>
 #include <math.h>
 #include <stdbool.h>
+#include <ctype.h>
+#include <limits.h>
+#include <setjmp.h>
+#include <time.h>
 
-#include <sys/stat.h>
-#include <sys/types.h>
-#include <unistd.h>
-
-#ifdef _WIN32
-#include <direct.h>
-#endif
+#include <pthread.h>
 
 #include <cairo/cairo.h>
 #include <png.h>
 #include <zlib.h>
 
 #include "sgd.h"
+#include "libsgd.h"
+
+#ifdef _WIN32
+#define fseeko      _fseeki64
+#endif
 
 #define MIN(a, b)   ((a) < (b) ? (a) : (b))
 #define MAX(a, b)   ((a) > (b) ? (a) : (b))
 
-#define MAX_WIDTH   2048
-#define MAX_HEIGHT  2048
+/* largest side of a cairo image surface */
+#define MAX_IMAGE_WIDTH 32767
+
+/* MRCI tiles are usually 128 pixels square */
+#define MIN_TILE_WIDTH  8
+#define MAX_TILE_WIDTH  1024
 
-#define TILE_WIDTH  128
-#define TILE_HEIGHT 128
+/* tiles of 24 bits per pixel are RGB, others palette indices */
+#define RGB_DEPTH       24
+#define RGB_CACHE_SIZE  4096
 
-#define MAX_TILES   ((MAX_WIDTH / TILE_WIDTH) * (MAX_HEIGHT / TILE_HEIGHT))
+/* tile_ref, tile_last, tile_fill and tile_color */
+#define TILE_INFO_SIZE  (2 * sizeof(int) + 2 * sizeof(int16_t))
 
-#define MAX_BASE    (MAX_WIDTH * MAX_HEIGHT)
+/*
+ * Zeroed space after the end of file data, so that fixed size
+ * structures near the end can be read without bounds checks.
+ */
+#define BASE_SLACK  SGD_SLACK
+
+/*
+ * State of one open file. Library calls and their worker threads point
+ * cur at it, and the rest of this file reaches it through cur.
+ */
+struct sgd_file {
+    sgd_options         opt;
+    png_color           png_pal[16];
+    uint8_t             colormap[256];
+
+    uint8_t             *base;
+    uint32_t            file_size;
+
+    /* opened by sgd_scan_path(), without image data */
+    bool                scanned;
+
+    int                 sgd_width;
+    int                 sgd_height;
+
+    int                 h_tiles;
+    int                 v_tiles;
+    int                 tile_w;
+    int                 tile_h;
+    int                 tile_depth;
+
+    /* palette colors of RGB pixels seen, as 1 << 31 | rgb << 8 | color */
+    uint32_t            rgb_cache[RGB_CACHE_SIZE];
+
+    SGDDirectoryType0   *dir;
+    SGDMrciBitmap       *bitmap;
+
+    /*
+     * Reordered entry lists of sets, by directory slot. The file image
+     * itself is never modified.
+     */
+    uint32_t            **set_order;
+
+    struct set_group    *groups;
+    int                 num_groups;
+
+    /*
+     * Decoded tiles of the current strip, h_tiles per tile row.
+     */
+    uint8_t             *tiles;
+
+    /*
+     * Tiles with byte-identical compressed data are decoded once. For
+     * each tile, tile_ref holds the index of the first tile with the same
+     * data, and tile_last the index of its last duplicate. When streaming,
+     * decoded tiles still needed by later strips are kept in tile_cache.
+     */
+    int                 *tile_ref;
+    int                 *tile_last;
+    uint8_t             **tile_cache;
+
+    /* tile data as stored, for tiles not of 8 bit palette indices */
+    uint8_t             *tile_raw;
+
+    /*
+     * For tiles of a single palette index, tile_fill holds that index and
+     * tile_color its output color if no label overlaps the tile, otherwise
+     * both are -1. Data of uniform duplicate tiles is not copied.
+     */
+    int16_t             *tile_fill;
+    int16_t             *tile_color;
+
+    int                 tiles_decoded;
+    int                 tiles_copied;
+
+    /*
+     * Image is processed in horizontal strips of this many rows. This is
+     * sgd_height, unless streaming, when it is one tile row.
+     */
+    int                 strip_height;
+    struct strip        *strips;
+    uint8_t             *backgr;
+
+    /* coverage of set groups, a row for each image row, NULL if none */
+    struct cover_row    *cover;
+
+    int                 map_tiles;
+    int                 map_tiles_blank;
+    int                 map_tiles_dup;
+
+    /*
+     * Bytes held in large buffers, and the most held at once. Tracked to
+     * check estimate_memory() against.
+     */
+    size_t              mem_used;
+    size_t              mem_peak;
+    size_t              base_alloc;
+
+    /* seconds spent on base image and set images by last convert() */
+    double              base_time;
+    double              set_time;
+
+    const sgd_sink      *sink;
+    pthread_mutex_t     sink_lock;
+
+    /* encoder threads of the conversion in progress, NULL if none */
+    struct encoder      *encoder;
+
+    /* first error in a worker thread */
+    int                 job_error;
+    char                job_msg[256];
+    pthread_mutex_t     job_lock;
+};
 
-static uint8_t base[MAX_BASE + 4096];
-static uint32_t file_size;
+static __thread sgd_file *cur;
 
-#define base_off        (base + SGD_OFFSET)
-#define file_size_off   (file_size - SGD_OFFSET)
+static inline size_t tile_pixels(void)
+{
+    return (size_t)cur->tile_w * cur->tile_h;
+}
 
-static int sgd_width;
-static int sgd_height;
+/* file data, offsets in it are relative to this */
+static inline uint8_t *base_off(void)
+{
+    return cur->base + SGD_OFFSET;
+}
 
-static int h_tiles;
-static int v_tiles;
+static inline uint32_t file_size_off(void)
+{
+    return cur->file_size - SGD_OFFSET;
+}
 
-static int comp_lvl = Z_DEFAULT_COMPRESSION;
+#define tile_data(i)    (&cur->tiles[(size_t)(i) * tile_pixels()])
 
 /*
  * Made up palette. Replace this with actual SGD palette
@@ -63,12 +191,59 @@ static const png_color sgd_pal[8] = {
     { 0xff, 0xff, 0xff },
 };
 
-static png_color png_pal[16];
-static uint8_t tiles[MAX_TILES][TILE_WIDTH * TILE_HEIGHT];
+/*
+ * Errors are raised with panic(), which returns to the innermost library
+ * call or worker thread in progress, see run_protected().
+ */
+static __thread jmp_buf *panic_jmp;
+static __thread int last_errno;
+static __thread char last_error[256];
+
+/*
+ * Resources held by the calling thread that are released when an error
+ * unwinds past them. Each is registered once acquired, and unregistered
+ * when released normally.
+ */
+typedef struct {
+    void    (*fn)(void *);
+    void    *arg;
+} cleanup_t;
+
+#define MAX_CLEANUPS    32
+
+static __thread cleanup_t cleanups[MAX_CLEANUPS];
+static __thread int num_cleanups;
+
+/* cleanups below this belong to outer calls */
+static __thread int cleanup_depth;
+
+/*
+ * Cleanups run before the jump, while the stack frames holding their
+ * resources are still valid.
+ */
+__attribute__((__noreturn__))
+static void raise_error(int err, const char *fmt, va_list ap)
+{
+    vsnprintf(last_error, sizeof(last_error), fmt, ap);
+    last_errno = err;
+
+    while (num_cleanups > cleanup_depth) {
+        cleanup_t *c = &cleanups[--num_cleanups];
+        c->fn(c->arg);
+    }
+
+    longjmp(*panic_jmp, 1);
+}
 
-static SGDDirectoryType0 *dir;
+__attribute__((__format__(printf, 2, 3)))
+__attribute__((__noreturn__))
+static void fail(int err, const char *fmt, ...)
+{
+    va_list ap;
 
-static const char *cur_fn;
+    va_start(ap, fmt);
+    raise_error(err, fmt, ap);
+}
 
 __attribute__((__format__(printf, 1, 2)))
 __attribute__((__noreturn__))
@@ -76,15 +251,177 @@ static void panic(const char *fmt, ...)
 {
     va_list ap;
 
-    if (cur_fn)
-        fprintf(stderr, "%s: ", cur_fn);
+    va_start(ap, fmt);
+    raise_error(EINVAL, fmt, ap);
+}
+
+static void push_cleanup(void (*fn)(void *), void *arg)
+{
+    if (num_cleanups == MAX_CLEANUPS) {
+        fn(arg);
+        panic("Too many cleanups");
+    }
+    cleanups[num_cleanups++] = (cleanup_t){ fn, arg };
+}
+
+/*
+ * Unregister cleanup of arg, and release it if run is set.
+ */
+static void pop_cleanup(void *arg, bool run)
+{
+    for (int i = num_cleanups - 1; i >= 0; i--) {
+        if (cleanups[i].arg == arg) {
+            cleanup_t c = cleanups[i];
+            memmove(&cleanups[i], &cleanups[i + 1], (--num_cleanups - i) * sizeof(cleanup_t));
+            if (run)
+                c.fn(c.arg);
+            return;
+        }
+    }
+}
+
+#define out_of_memory() fail(ENOMEM, "Out of memory")
+
+__attribute__((__format__(printf, 1, 2)))
+static void info(const char *fmt, ...)
+{
+    char buf[256];
+    va_list ap;
+
+    if (!cur->opt.log)
+        return;
 
     va_start(ap, fmt);
-    vfprintf(stderr, fmt, ap);
+    vsnprintf(buf, sizeof(buf), fmt, ap);
     va_end(ap);
 
-    fputc('\n', stderr);
-    exit(1);
+    cur->opt.log(cur->opt.log_opaque, buf);
+}
+
+/*
+ * Account for n bytes of a large buffer allocated, or freed when negative.
+ */
+static void count_mem(ptrdiff_t n)
+{
+    size_t used = __atomic_add_fetch(&cur->mem_used, n, __ATOMIC_RELAXED);
+    size_t peak = __atomic_load_n(&cur->mem_peak, __ATOMIC_RELAXED);
+
+    while (used > peak && !__atomic_compare_exchange_n(&cur->mem_peak, &peak, used, true,
+                                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/*
+ * Big buffers are pooled when released, for all files and threads, and
+ * taken again by requests they fit without much waste. Otherwise the
+ * biggest smaller one is dropped for a new one, so that buffers grow to
+ * the largest sizes seen, and batches of files don't keep faulting in
+ * fresh pages. The biggest buffers are dropped when those held exceed the
+ * limit. Buffers carry their size in front.
+ */
+#define POOL_MIN    (32 << 10)
+#define POOL_SLOTS  64
+#define POOL_LIMIT  ((size_t)512 << 20)
+
+typedef union {
+    size_t      size;
+    max_align_t align;
+} pool_hdr_t;
+
+static struct {
+    pthread_mutex_t lock;
+    pool_hdr_t  *free[POOL_SLOTS];
+    int         num_free;
+    size_t      held;
+    size_t      limit;
+    size_t      requests;
+    size_t      hits;
+} pool = { .lock = PTHREAD_MUTEX_INITIALIZER, .limit = POOL_LIMIT };
+
+/*
+ * Called with lock held.
+ */
+static void pool_trim(void)
+{
+    while (pool.held > pool.limit) {
+        int k = 0;
+        for (int i = 1; i < pool.num_free; i++)
+            if (pool.free[i]->size > pool.free[k]->size)
+                k = i;
+        pool.held -= pool.free[k]->size;
+        free(pool.free[k]);
+        pool.free[k] = pool.free[--pool.num_free];
+    }
+}
+
+static void *pool_alloc(size_t size)
+{
+    pool_hdr_t *h = NULL;
+
+    if (size >= POOL_MIN) {
+        int fit = -1, grow = -1;
+
+        pthread_mutex_lock(&pool.lock);
+        pool.requests++;
+        for (int i = 0; i < pool.num_free; i++) {
+            size_t n = pool.free[i]->size;
+            if (n >= size && n / 4 <= size && (fit < 0 || n < pool.free[fit]->size))
+                fit = i;
+            if (n < size && (grow < 0 || n > pool.free[grow]->size))
+                grow = i;
+        }
+        int i = fit >= 0 ? fit : grow;
+        if (i >= 0) {
+            h = pool.free[i];
+            pool.free[i] = pool.free[--pool.num_free];
+            pool.held -= h->size;
+        }
+        if (fit >= 0)
+            pool.hits++;
+        pthread_mutex_unlock(&pool.lock);
+
+        if (fit >= 0)
+            return h + 1;
+        free(h);
+    }
+
+    if (!(h = malloc(sizeof(pool_hdr_t) + size)))
+        return NULL;
+    h->size = size;
+    return h + 1;
+}
+
+static void pool_free(void *p)
+{
+    if (!p)
+        return;
+
+    pool_hdr_t *h = (pool_hdr_t *)p - 1;
+
+    if (h->size >= POOL_MIN) {
+        pthread_mutex_lock(&pool.lock);
+        if (pool.num_free < POOL_SLOTS) {
+            pool.free[pool.num_free++] = h;
+            pool.held += h->size;
+            h = NULL;
+        } else {
+            /* full, keep the bigger ones */
+            int k = 0;
+            for (int i = 1; i < POOL_SLOTS; i++)
+                if (pool.free[i]->size < pool.free[k]->size)
+                    k = i;
+            if (pool.free[k]->size < h->size) {
+                pool_hdr_t *t = pool.free[k];
+                pool.free[k] = h;
+                pool.held += h->size - t->size;
+                h = t;
+            }
+        }
+        pool_trim();
+        pthread_mutex_unlock(&pool.lock);
+    }
+
+    free(h);
 }
 
 __attribute__((__format__(printf, 3, 4)))
@@ -106,28 +443,40 @@ static int s_snprintf(char *buf, size_t size, const char *fmt, ...)
 #define PAL_BLACK   0
 #define PAL_WHITE   7
 
-static uint8_t colormap[256];
-
-static void remap_colors(const png_color *pal, int ncolors)
+static int nearest_color(int r, int g, int b)
 {
-    for (int i = 0; i < ncolors; i++) {
-        int r = pal[i].red;
-        int g = pal[i].green;
-        int b = pal[i].blue;
-        int best = 0;
-        int min_dist = INT_MAX;
-        for (int j = 0; j < 8; j++) {
-            int rd = png_pal[j].red   - r;
-            int gd = png_pal[j].green - g;
-            int bd = png_pal[j].blue  - b;
-            int dist = abs(rd) + abs(gd) + abs(bd);
-            if (dist < min_dist) {
-                min_dist = dist;
-                best = j;
-            }
+    int best = 0;
+    int min_dist = INT_MAX;
+    for (int j = 0; j < 8; j++) {
+        int rd = cur->png_pal[j].red   - r;
+        int gd = cur->png_pal[j].green - g;
+        int bd = cur->png_pal[j].blue  - b;
+        int dist = abs(rd) + abs(gd) + abs(bd);
+        if (dist < min_dist) {
+            min_dist = dist;
+            best = j;
         }
-        colormap[i] = best;
     }
+    return best;
+}
+
+static void remap_colors(const png_color *pal, int ncolors)
+{
+    for (int i = 0; i < ncolors; i++)
+        cur->colormap[i] = nearest_color(pal[i].red, pal[i].green, pal[i].blue);
+}
+
+/*
+ * Output color of an RGB pixel. Images hold few distinct colors, so
+ * those seen are kept in a direct-mapped cache.
+ */
+static inline int rgb_color(const uint8_t *p)
+{
+    uint32_t rgb = (uint32_t)p[0] << 16 | p[1] << 8 | p[2];
+    uint32_t *e = &cur->rgb_cache[(rgb ^ rgb >> 12) % RGB_CACHE_SIZE];
+    if ((*e >> 8) != (1u << 23 | rgb))
+        *e = 1u << 31 | rgb << 8 | nearest_color(p[0], p[1], p[2]);
+    return *e & 0xff;
 }
 
 static void parse_pal(SGDMrciPalette *e)
@@ -163,26 +512,180 @@ static void parse_pal(SGDMrciPalette *e)
     remap_colors(pal, e->num_colors);
 }
 
+#define tile_at(i)  ((SGDMrciTile *)(base_off() + cur->bitmap->addr[i]))
+
+/* bytes per row of stored tile data */
+static inline size_t tile_stride(void)
+{
+    if (cur->tile_depth == RGB_DEPTH)
+        return 3 * (size_t)cur->tile_w;
+    return ((size_t)cur->tile_w * cur->tile_depth + 7) / 8;
+}
+
+static bool same_tile(int i, int j)
+{
+    SGDMrciTile *t1 = tile_at(i);
+    SGDMrciTile *t2 = tile_at(j);
+    return t1 == t2 || (t1->size == t2->size && !memcmp(t1->data, t2->data, t1->size - sizeof(uint32_t)));
+}
+
+/*
+ * Find duplicates among tiles of rows [row, end_row). Other tiles are
+ * never decoded.
+ */
+static void hash_tiles(int row, int end_row)
+{
+    int num_tiles = cur->h_tiles * cur->v_tiles;
+    int hash_size = 1;
+    while (hash_size < 2 * num_tiles)
+        hash_size <<= 1;
+
+    int *hash = malloc(hash_size * sizeof(int));
+    cur->tile_ref   = malloc(num_tiles * sizeof(int));
+    cur->tile_last  = malloc(num_tiles * sizeof(int));
+    cur->tile_fill  = malloc(num_tiles * sizeof(int16_t));
+    cur->tile_color = malloc(num_tiles * sizeof(int16_t));
+    if (!hash || !cur->tile_ref || !cur->tile_last || !cur->tile_fill || !cur->tile_color) {
+        free(hash);
+        out_of_memory();
+    }
+    memset(hash, 0xff, hash_size * sizeof(int));
+    count_mem(hash_size * sizeof(int) + num_tiles * TILE_INFO_SIZE);
+
+    for (int i = row * cur->h_tiles; i < end_row * cur->h_tiles; i++) {
+        SGDMrciTile *t = tile_at(i);
+        uint32_t h = crc32(0, t->data, t->size - sizeof(uint32_t));
+        for (h &= hash_size - 1; hash[h] >= 0 && !same_tile(hash[h], i); h = (h + 1) & (hash_size - 1))
+            ;
+        if (hash[h] < 0)
+            hash[h] = i;
+        cur->tile_ref[i] = hash[h];
+        cur->tile_last[hash[h]] = i;
+    }
+
+    free(hash);
+    count_mem(-hash_size * sizeof(int));
+}
+
 static void parse_bmp(SGDMrciBitmap *b)
 {
     if (b->type != SGD_BMPTILELIST)
         panic("Bad tile list type");
+    if (cur->h_tiles * cur->v_tiles > (file_size_off() - ((uint8_t *)b - base_off())) / sizeof(uint32_t))
+        panic("Bad tile list size");
 
-    for (int i = 0; i < h_tiles * v_tiles; i++) {
-        if (b->addr[i] > file_size_off)
+    for (int i = 0; i < cur->h_tiles * cur->v_tiles; i++) {
+        if (b->addr[i] > file_size_off())
             panic("Bad tile address");
-        SGDMrciTile *t = (SGDMrciTile *)(base_off + b->addr[i]);
+        SGDMrciTile *t = (SGDMrciTile *)(base_off() + b->addr[i]);
         if (t->type != SGD_BMPTILE)
             panic("Bad tile type");
         if (t->encoding != 1)
             panic("Bad tile encoding");
-        if (t->size - sizeof(uint32_t) > file_size_off - b->addr[i])
+        if (t->size - sizeof(uint32_t) > file_size_off() - b->addr[i])
             panic("Bad tile size");
+    }
+
+    cur->bitmap = b;
+}
+
+/*
+ * Decode tile t in tile column col, of 1, 2 or 4 bit palette indices or
+ * of RGB pixels, to one byte per pixel: palette indices, or output colors
+ * for RGB. Returns the number of pixels decoded.
+ */
+static size_t unpack_tile(uint8_t *dst, SGDMrciTile *t, int col)
+{
+    int w = MIN(cur->tile_w, cur->sgd_width - col * cur->tile_w);
+    size_t stride = cur->tile_depth == RGB_DEPTH ? 3 * (size_t)w : ((size_t)w * cur->tile_depth + 7) / 8;
+
+    if (!cur->tile_raw) {
+        cur->tile_raw = pool_alloc(tile_stride() * cur->tile_h);
+        if (!cur->tile_raw)
+            out_of_memory();
+        count_mem(tile_stride() * cur->tile_h);
+    }
+    /* edge tiles hold rows of their own width only */
+    uLongf rawlen = stride * cur->tile_h;
+    int res = uncompress(cur->tile_raw, &rawlen, t->data, t->size - sizeof(uint32_t));
+    if (res)
+        panic("uncompress() failed with %d", res);
+    if (rawlen % stride)
+        panic("Bad tile size");
+
+    int rows = rawlen / stride;
+    const uint8_t *src = cur->tile_raw;
+    for (int y = 0; y < rows; y++, src += stride, dst += w) {
+        if (cur->tile_depth == RGB_DEPTH) {
+            for (int x = 0; x < w; x++)
+                dst[x] = rgb_color(&src[3 * x]);
+        } else {
+            int depth = cur->tile_depth;
+            int mask = (1 << depth) - 1;
+            for (int x = 0; x < w; x++) {
+                int bit = x * depth;
+                dst[x] = src[bit / 8] >> (8 - depth - bit % 8) & mask;
+            }
+        }
+    }
+    return (size_t)rows * w;
+}
+
+/*
+ * Decode tile rows [row, row + num_rows) into tiles.
+ */
+static void decode_tiles(int row, int num_rows)
+{
+    int first = row * cur->h_tiles;
+    int end = first + num_rows * cur->h_tiles;
+
+    for (int i = first; i < end; i++) {
+        int ref = cur->tile_ref[i];
+
+        if (ref != i) {
+            cur->tile_fill[i] = cur->tile_fill[ref];
+            if (cur->tile_fill[i] >= 0) {
+                /* nothing to copy */
+            } else if (ref >= first) {
+                memcpy(tile_data(i - first), tile_data(ref - first), tile_pixels());
+            } else {
+                memcpy(tile_data(i - first), cur->tile_cache[ref], tile_pixels());
+                if (cur->tile_last[ref] == i) {
+                    free(cur->tile_cache[ref]);
+                    cur->tile_cache[ref] = NULL;
+                    count_mem(-tile_pixels());
+                }
+            }
+            cur->tiles_copied++;
+            continue;
+        }
+
+        SGDMrciTile *t = tile_at(i);
+        uint8_t *data = tile_data(i - first);
+        uLongf outlen;
+        if (cur->tile_depth == 8) {
+            outlen = tile_pixels();
+            int res = uncompress(data, &outlen, t->data, t->size - sizeof(uint32_t));
+            if (res)
+                panic("uncompress() failed with %d", res);
+        } else {
+            outlen = unpack_tile(data, t, i % cur->h_tiles);
+        }
+        cur->tiles_decoded++;
 
-        uLongf outlen = TILE_WIDTH * TILE_HEIGHT;
-        int res = uncompress(tiles[i], &outlen, t->data, t->size - sizeof(uint32_t));
-        if (res)
-            panic("uncompress() failed with %d", res);
+        cur->tile_fill[i] = outlen && !memcmp(data, data + 1, outlen - 1) ? data[0] : -1;
+
+        if (cur->tile_last[i] >= end && cur->tile_fill[i] < 0) {
+            if (!cur->tile_cache) {
+                if (!(cur->tile_cache = calloc(cur->h_tiles * cur->v_tiles, sizeof(uint8_t *))))
+                    out_of_memory();
+                count_mem(cur->h_tiles * cur->v_tiles * sizeof(uint8_t *));
+            }
+            if (!(cur->tile_cache[i] = malloc(tile_pixels())))
+                out_of_memory();
+            count_mem(tile_pixels());
+            memcpy(cur->tile_cache[i], tile_data(i - first), tile_pixels());
+        }
     }
 }
 
@@ -190,39 +693,60 @@ static void parse_mrci(SGDMrciHeader *m)
 {
     if (m->hdr.type != SGD_MRCIHEADER)
         panic("Bad MRCI header type");
-    if (m->width - 1 > MAX_WIDTH - 1 || m->height - 1 > MAX_HEIGHT - 1)
+    if (!m->width || !m->height)
         panic("Bad MRCI image size");
-    if (m->bytes_per_pixel != 1 || m->bit_depth != 8)
+    if ((uint64_t)m->width * m->height > cur->opt.max_size ||
+        m->width > MAX_IMAGE_WIDTH || m->height > MAX_IMAGE_WIDTH)
+        fail(EFBIG, "MRCI image too big");
+    if (m->bytes_per_pixel == 1 && (m->bit_depth == 1 || m->bit_depth == 2 ||
+                                    m->bit_depth == 4 || m->bit_depth == 8))
+        cur->tile_depth = m->bit_depth;
+    else if (m->bytes_per_pixel == 3 && (m->bit_depth == 8 || m->bit_depth == 24))
+        cur->tile_depth = RGB_DEPTH;
+    else
         panic("Bad MRCI bit depth or bytes per pixel");
-    if (m->tile_width != TILE_WIDTH || m->tile_height != TILE_HEIGHT)
+    if (m->tile_width  < MIN_TILE_WIDTH || m->tile_width  > MAX_TILE_WIDTH ||
+        m->tile_height < MIN_TILE_WIDTH || m->tile_height > MAX_TILE_WIDTH)
         panic("Bad MRCI tile size");
-    if (m->palette_addr > file_size_off)
+    if (m->palette_addr > file_size_off())
         panic("Bad MRCI palette address");
-    if (m->bitmap_addr > file_size_off)
+    if (m->bitmap_addr > file_size_off())
         panic("Bad MRCI bitmap address");
 
-    sgd_width  = m->width;
-    sgd_height = m->height;
-    h_tiles = (m->width  + TILE_WIDTH  - 1) / TILE_WIDTH;
-    v_tiles = (m->height + TILE_HEIGHT - 1) / TILE_HEIGHT;
-
-    parse_pal((SGDMrciPalette *)(base_off + m->palette_addr));
-    parse_bmp((SGDMrciBitmap  *)(base_off + m->bitmap_addr));
+    cur->sgd_width  = m->width;
+    cur->sgd_height = m->height;
+    cur->tile_w = m->tile_width;
+    cur->tile_h = m->tile_height;
+    cur->h_tiles = (m->width  + cur->tile_w - 1) / cur->tile_w;
+    cur->v_tiles = (m->height + cur->tile_h - 1) / cur->tile_h;
+
+    /* palette and tiles are not read when scanning */
+    if (cur->scanned)
+        return;
+
+    /* RGB tiles are mapped to output colors as they are decoded */
+    if (cur->tile_depth == RGB_DEPTH) {
+        for (int i = 0; i < 8; i++)
+            cur->colormap[i] = i;
+    } else {
+        parse_pal((SGDMrciPalette *)(base_off() + m->palette_addr));
+    }
+    parse_bmp((SGDMrciBitmap  *)(base_off() + m->bitmap_addr));
 }
 
 static SGDDirectoryType0 *find_directory(void)
 {
-    SGDDirectoryTable *t = (SGDDirectoryTable *)(base + 0x4c);
+    SGDDirectoryTable *t = (SGDDirectoryTable *)(cur->base + 0x4c);
     if (t->num_entries > 8)
         panic("Bad number of directory table entries");
     for (int i = 0; i < t->num_entries; i++) {
         if (t->entry[i].type == 0) {
-            if (t->entry[i].addr > file_size)
+            if (t->entry[i].addr > cur->file_size)
                 panic("Bad directory address");
-            SGDDirectory *d = (SGDDirectory *)(base + t->entry[i].addr);
+            SGDDirectory *d = (SGDDirectory *)(cur->base + t->entry[i].addr);
             if (d->hdr.type != SGD_BULKDATA)
                 panic("Bad directory type");
-            if (d->type0.num_entries > (file_size - t->entry[i].addr) / sizeof(uint32_t))
+            if (d->type0.num_entries > (cur->file_size - t->entry[i].addr) / sizeof(uint32_t))
                 panic("Bad number of directory entries");
             return &d->type0;
         }
@@ -230,72 +754,94 @@ static SGDDirectoryType0 *find_directory(void)
     panic("Directory 0 not found");
 }
 
-static SGDEntry *find_entry(int index)
+static int find_slot(int index)
 {
-    for (int i = 0; i < dir->num_entries; i++) {
-        SGDEntry *e = (SGDEntry *)(base_off + dir->addr[i]);
+    for (int i = 0; i < cur->dir->num_entries; i++) {
+        SGDEntry *e = (SGDEntry *)(base_off() + cur->dir->addr[i]);
         if (e->hdr.index == index)
-            return e;
+            return i;
     }
     panic("Entry %d not found", index);
 }
 
-static void validate_set_r(SGDEntry *set)
+#define entry_at(i)     ((SGDEntry *)(base_off() + cur->dir->addr[i]))
+#define find_entry(i)   entry_at(find_slot(i))
+
+static int entry_slot(SGDEntry *e)
+{
+    for (int i = 0; i < cur->dir->num_entries; i++)
+        if (entry_at(i) == e)
+            return i;
+    panic("Entry not in directory");
+}
+
+static const uint32_t *set_entries(SGDEntry *set)
 {
-    if (set->set.num_entries == -1)
+    uint32_t *order = cur->set_order ? cur->set_order[entry_slot(set)] : NULL;
+    return order ? order : set->set.entries;
+}
+
+static void validate_set_r(int slot, uint8_t *visiting)
+{
+    if (visiting[slot])
         panic("Cycle encountered");
 
-    int num_entries = set->set.num_entries;
-    set->set.num_entries = -1;
-    for (int i = 0; i < num_entries; i++) {
-        SGDEntry *e = find_entry(set->set.entries[i]);
-        if (e->hdr.type == SGD_SET)
-            validate_set_r(e);
+    SGDEntry *set = entry_at(slot);
+    visiting[slot] = 1;
+    for (int i = 0; i < set->set.num_entries; i++) {
+        int s = find_slot(set->set.entries[i]);
+        if (entry_at(s)->hdr.type == SGD_SET)
+            validate_set_r(s, visiting);
     }
-    set->set.num_entries = num_entries;
+    visiting[slot] = 0;
 }
 
 static void validate_directory(void)
 {
-    dir = find_directory();
-    for (int i = 0; i < dir->num_entries; i++) {
-        if (dir->addr[i] > file_size_off)
+    cur->dir = find_directory();
+    for (int i = 0; i < cur->dir->num_entries; i++) {
+        if (cur->dir->addr[i] > file_size_off())
             panic("Bad entry address");
-        SGDEntry *e = (SGDEntry *)(base_off + dir->addr[i]);
+        SGDEntry *e = (SGDEntry *)(base_off() + cur->dir->addr[i]);
         switch (e->hdr.type) {
         case SGD_POLYLINE2D:
-            if (e->polyline.num_points > (file_size_off - dir->addr[i]) / sizeof(SGDPoint))
+            if (e->polyline.num_points > (file_size_off() - cur->dir->addr[i]) / sizeof(SGDPoint))
                 panic("Bad number of points");
             break;
         case SGD_LASSO2D:
-            if (e->lasso.num_points > (file_size_off - dir->addr[i]) / sizeof(SGDPoint))
+            if (e->lasso.num_points > (file_size_off() - cur->dir->addr[i]) / sizeof(SGDPoint))
                 panic("Bad number of points");
             break;
         case SGD_TEXTLINE2D:
-            if (!memchr(e->textline.text, 0, file_size_off - dir->addr[i]))
+            if (!memchr(e->textline.text, 0, file_size_off() - cur->dir->addr[i]))
                 panic("Text too long");
             break;
         case SGD_SIMPLEAREA:
         case SGD_CONNECTEDAREA:
-            if (e->simple_area.num_entries > (file_size_off - dir->addr[i]) / sizeof(uint32_t))
+            if (e->simple_area.num_entries > (file_size_off() - cur->dir->addr[i]) / sizeof(uint32_t))
                 panic("Bad number of entries");
             break;
         case SGD_SET:
-            if (e->set.num_entries > (file_size_off - dir->addr[i]) / sizeof(uint32_t))
+            if (e->set.num_entries > (file_size_off() - cur->dir->addr[i]) / sizeof(uint32_t))
                 panic("Bad number of entries");
             break;
         }
     }
-    for (int i = 0; i < dir->num_entries; i++) {
-        SGDEntry *e = (SGDEntry *)(base_off + dir->addr[i]);
+    uint8_t *visiting = calloc(cur->dir->num_entries, 1);
+    if (!visiting)
+        out_of_memory();
+    push_cleanup(free, visiting);
+    for (int i = 0; i < cur->dir->num_entries; i++) {
+        SGDEntry *e = (SGDEntry *)(base_off() + cur->dir->addr[i]);
         if (e->hdr.type == SGD_SET)
-            validate_set_r(e);
+            validate_set_r(i, visiting);
     }
+    pop_cleanup(visiting, true);
 }
 
 static void parse_header(void)
 {
-    SGDFileHeader *h = (SGDFileHeader *)base;
+    SGDFileHeader *h = (SGDFileHeader *)cur->base;
     if (h->magic1 != 0x0a0090 || h->magic2 != 0x55555555)
         panic("Bad SGD magic");
     if (h->ver_major != 0x07db || (h->ver_minor != 0x0407 && h->ver_minor != 0x0406))
@@ -304,12 +850,12 @@ static void parse_header(void)
         panic("Bad SGD flags");
 
     validate_directory();
-    parse_mrci((SGDMrciHeader *)(base_off + 8));
+    parse_mrci((SGDMrciHeader *)(base_off() + 8));
 }
 
 static void line_to(cairo_t *cr, SGDPoint p)
 {
-    cairo_line_to(cr, rintf(p.x), sgd_height - rintf(p.y));
+    cairo_line_to(cr, rintf(p.x), cur->sgd_height - rintf(p.y));
 }
 
 static void draw_polyline(cairo_t *cr, SGDEntry *e, bool reverse)
@@ -339,10 +885,44 @@ static void draw_polyline(cairo_t *cr, SGDEntry *e, bool reverse)
 
 #define set_color(cr, a)    cairo_set_source_rgba(cr, 0, 0, 0, a)
 
-static cairo_surface_t *render_labels(void)
+static cairo_surface_t *create_mask_surface(int width, int height)
+{
+    int stride = cairo_format_stride_for_width(CAIRO_FORMAT_A8, width);
+    uint8_t *data = pool_alloc((size_t)stride * height);
+    if (!data)
+        out_of_memory();
+    memset(data, 0, (size_t)stride * height);
+    count_mem((size_t)stride * height);
+    return cairo_image_surface_create_for_data(data, CAIRO_FORMAT_A8, width, height, stride);
+}
+
+static void destroy_mask_surface(cairo_surface_t *surface)
+{
+    uint8_t *data = cairo_image_surface_get_data(surface);
+
+    count_mem(-(size_t)cairo_image_surface_get_stride(surface) * cairo_image_surface_get_height(surface));
+    cairo_surface_destroy(surface);
+    pool_free(data);
+}
+
+static void free_surface(void *surface)
 {
-    cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_A8, sgd_width, sgd_height);
+    destroy_mask_surface(surface);
+}
+
+static void free_context(void *cr)
+{
+    cairo_destroy(cr);
+}
+
+static cairo_surface_t *render_labels(int y, int height)
+{
+    cairo_surface_t *surface = create_mask_surface(cur->sgd_width, height);
+    push_cleanup(free_surface, surface);
     cairo_t *cr = cairo_create(surface);
+    push_cleanup(free_context, cr);
+
+    cairo_translate(cr, 0, -y);
 
     cairo_select_font_face(cr, "sans-serif", CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_BOLD);
     cairo_set_font_size(cr, 18.0);
@@ -353,8 +933,8 @@ static cairo_surface_t *render_labels(void)
     cairo_paint(cr);
     set_color(cr, 0);
 
-    for (int i = 0; i < dir->num_entries; i++) {
-        SGDEntry *e = (SGDEntry *)(base_off + dir->addr[i]);
+    for (int i = 0; i < cur->dir->num_entries; i++) {
+        SGDEntry *e = (SGDEntry *)(base_off() + cur->dir->addr[i]);
         if (!e->hdr.unk3)
             continue;
         switch (e->hdr.type) {
@@ -364,15 +944,16 @@ static cairo_surface_t *render_labels(void)
             cairo_stroke(cr);
             break;
         case SGD_TEXTLINE2D:
-            cairo_move_to(cr, e->textline.pos.x, sgd_height - e->textline.pos.y);
+            cairo_move_to(cr, e->textline.pos.x, cur->sgd_height - e->textline.pos.y);
             cairo_show_text(cr, e->textline.text);
             break;
         }
     }
 
-    cairo_destroy(cr);
+    pop_cleanup(cr, true);
     cairo_surface_flush(surface);
 
+    /* still registered, until caller releases it */
     return surface;
 }
 
@@ -381,7 +962,7 @@ typedef struct {
     int max_x, max_y;
 } bounds_t;
 
-#define EMPTY_BOUNDS (bounds_t){9999, 9999, -9999, -9999}
+#define EMPTY_BOUNDS (bounds_t){INT_MAX, INT_MAX, INT_MIN, INT_MIN}
 
 static void add_point(bounds_t *b, int x, int y)
 {
@@ -416,8 +997,8 @@ static int bounds_area(const bounds_t *b)
 static void expand_bounds(bounds_t *b)
 {
     if (!bounds_empty(b)) {
-        int mx = MIN(MIN(75, b->min_x), sgd_width - b->max_x - 1);
-        int my = MIN(MIN(75, b->min_y), sgd_height - b->max_y - 1);
+        int mx = MIN(MIN(75, b->min_x), cur->sgd_width - b->max_x - 1);
+        int my = MIN(MIN(75, b->min_y), cur->sgd_height - b->max_y - 1);
         b->min_x -= mx;
         b->min_y -= my;
         b->max_x += mx;
@@ -429,15 +1010,15 @@ static void calc_polyline_bounds(bounds_t *b, SGDEntry *e)
 {
     if (e->polyline.point1) {
         SGDEntry *p1 = find_entry(e->polyline.point1);
-        add_point(b, p1->point.point.x, sgd_height - p1->point.point.y);
+        add_point(b, p1->point.point.x, cur->sgd_height - p1->point.point.y);
     }
 
     for (int i = 0; i < e->polyline.num_points; i++)
-        add_point(b, e->polyline.points[i].x, sgd_height - e->polyline.points[i].y);
+        add_point(b, e->polyline.points[i].x, cur->sgd_height - e->polyline.points[i].y);
 
     if (e->polyline.point2) {
         SGDEntry *p2 = find_entry(e->polyline.point2);
-        add_point(b, p2->point.point.x, sgd_height - p2->point.point.y);
+        add_point(b, p2->point.point.x, cur->sgd_height - p2->point.point.y);
     }
 }
 
@@ -451,7 +1032,7 @@ static void calc_area_bounds(bounds_t *b, SGDEntry *e)
             break;
         case SGD_ELLIPTICALARC2D:;
             float x = s->elliptical_arc.points[0].x;
-            float y = sgd_height - s->elliptical_arc.points[0].y;
+            float y = cur->sgd_height - s->elliptical_arc.points[0].y;
             float r = (s->elliptical_arc.points[1].x - x) / 2;
             x += r;
             add_point(b, x - r, y - r);
@@ -466,7 +1047,7 @@ static void calc_entry_bounds(bounds_t *b, SGDEntry *e)
     switch (e->hdr.type) {
     case SGD_LASSO2D:
         for (int j = 0; j < e->lasso.num_points; j++)
-            add_point(b, e->lasso.points[j].x, sgd_height - e->lasso.points[j].y);
+            add_point(b, e->lasso.points[j].x, cur->sgd_height - e->lasso.points[j].y);
         break;
     case SGD_CONNECTEDAREA:
         for (int j = 0; j < e->simple_area.num_entries; j++) {
@@ -481,22 +1062,50 @@ static void calc_entry_bounds(bounds_t *b, SGDEntry *e)
     }
 }
 
+/*
+ * Move labelled areas to the end of set entry list. The reordered list is
+ * kept in set_order.
+ */
 static void fixup_set(SGDEntry *set)
 {
     int num_entries = set->set.num_entries;
+    if (num_entries < 2)
+        return;
+
+    if (!cur->set_order && !(cur->set_order = calloc(cur->dir->num_entries, sizeof(uint32_t *))))
+        out_of_memory();
+
+    uint32_t **order = &cur->set_order[entry_slot(set)];
+    if (!*order) {
+        if (!(*order = malloc(num_entries * sizeof(uint32_t))))
+            out_of_memory();
+        memcpy(*order, set->set.entries, num_entries * sizeof(uint32_t));
+    }
+
+    uint32_t *entries = *order;
     for (int i = 0; i < num_entries-1; i++) {
-        SGDEntry *e = find_entry(set->set.entries[i]);
-        SGDEntry *n = find_entry(set->set.entries[i+1]);
+        SGDEntry *e = find_entry(entries[i]);
+        SGDEntry *n = find_entry(entries[i+1]);
         if (e->hdr.type == SGD_TEXTLINE2D && strchr(e->textline.text, '-') && n->hdr.type == SGD_SIMPLEAREA) {
-            memmove(&set->set.entries[i], &set->set.entries[i+2], (num_entries-i-2)*sizeof(uint32_t));
-            set->set.entries[num_entries-2] = e->hdr.index;
-            set->set.entries[num_entries-1] = n->hdr.index;
+            memmove(&entries[i], &entries[i+2], (num_entries-i-2)*sizeof(uint32_t));
+            entries[num_entries-2] = e->hdr.index;
+            entries[num_entries-1] = n->hdr.index;
             num_entries-=2;
             i--;
         }
     }
 }
 
+static void free_set_order(void)
+{
+    if (cur->set_order) {
+        for (int i = 0; i < cur->dir->num_entries; i++)
+            free(cur->set_order[i]);
+        free(cur->set_order);
+        cur->set_order = NULL;
+    }
+}
+
 static int entry_has_shape(SGDEntry *e)
 {
     switch (e->hdr.type) {
@@ -518,17 +1127,17 @@ static int entry_has_shape(SGDEntry *e)
     }
 }
 
-#define SET_DRAWN   0x80000000
-
 static void calc_set_bounds_r(bounds_t *b, SGDEntry *set)
 {
     bounds_t min_b = EMPTY_BOUNDS;
     bounds_t max_b = EMPTY_BOUNDS;
     int min_area = INT_MAX;
+    const uint32_t *entries = set->set.entries;
 
-    if ((set->set.unk7 & ~SET_DRAWN) == 0x79) goto recurse;
+    if (set->set.unk7 == 0x79) goto recurse;
 
     fixup_set(set);
+    entries = set_entries(set);
 
     int last_shape = 0;
     bool textline = false;
@@ -538,7 +1147,7 @@ static void calc_set_bounds_r(bounds_t *b, SGDEntry *set)
         int start = i;
 
         for (; i < set->set.num_entries; i++) {
-            SGDEntry *e = find_entry(set->set.entries[i]);
+            SGDEntry *e = find_entry(entries[i]);
             if (e->hdr.type == SGD_TEXTLINE2D) {
                 if (textline)
                     break;
@@ -562,7 +1171,7 @@ static void calc_set_bounds_r(bounds_t *b, SGDEntry *set)
             last_shape = -1;
 
         for (int j = start; j < i; j++) {
-            SGDEntry *e = find_entry(set->set.entries[j]);
+            SGDEntry *e = find_entry(entries[j]);
             if (e->hdr.type == SGD_SET)
                 calc_set_bounds_r(&eb, e);
         }
@@ -591,13 +1200,12 @@ static void calc_set_bounds_r(bounds_t *b, SGDEntry *set)
 
 recurse:
     for (int i = 0; i < set->set.num_entries; i++) {
-        SGDEntry *e = find_entry(set->set.entries[i]);
+        SGDEntry *e = find_entry(entries[i]);
         if (e->hdr.type == SGD_SET)
             calc_set_bounds_r(b, e);
     }
 }
 
-#define COLOR_HOLE      0.0
 #define COLOR_SHAPE     0.5
 #define COLOR_LABEL     1.0
 
@@ -612,7 +1220,7 @@ static void render_area_mask(cairo_t *cr, SGDEntry *e)
             break;
         case SGD_ELLIPTICALARC2D:;
             float x = s->elliptical_arc.points[0].x;
-            float y = sgd_height - s->elliptical_arc.points[0].y;
+            float y = cur->sgd_height - s->elliptical_arc.points[0].y;
             float r = (s->elliptical_arc.points[1].x - x) / 2;
             x += r;
             cairo_arc(cr, x, y, r, 0, M_PI * 2);
@@ -622,10 +1230,16 @@ static void render_area_mask(cairo_t *cr, SGDEntry *e)
     }
 }
 
+/*
+ * Entries are drawn in file order. The order of fixup_set() is for bounds
+ * only, and the mask doesn't depend on whether crops were calculated.
+ */
 static void render_mask_r(cairo_t *cr, SGDEntry *set)
 {
+    const uint32_t *entries = set->set.entries;
+
     for (int i = 0; i < set->set.num_entries; i++) {
-        SGDEntry *e = find_entry(set->set.entries[i]);
+        SGDEntry *e = find_entry(entries[i]);
         switch (e->hdr.type) {
         case SGD_LASSO2D:
             set_color(cr, COLOR_SHAPE);
@@ -652,7 +1266,7 @@ static void render_mask_r(cairo_t *cr, SGDEntry *set)
     }
 
     for (int i = 0; i < set->set.num_entries; i++) {
-        SGDEntry *e = find_entry(set->set.entries[i]);
+        SGDEntry *e = find_entry(entries[i]);
         if (e->hdr.type == SGD_SET)
             render_mask_r(cr, e);
     }
@@ -664,134 +1278,473 @@ static void my_png_error_fn(png_structp png_ptr, png_const_charp error_msg)
     panic("libpng error: %s", error_msg);
 }
 
-static void write_rows(const char *path, png_bytepp row_pointers, int width, int height, int ncolors)
+/*
+ * PNG images are encoded to memory and handed to the I/O layer for
+ * writing when complete.
+ */
+typedef struct {
+    png_structp png_ptr;
+    png_infop   info_ptr;
+    uint8_t     *data;
+    size_t      size;
+    size_t      max_size;
+    char        *path;
+} png_writer_t;
+
+static void png_write_fn(png_structp png_ptr, png_bytep data, png_size_t length)
 {
-    FILE *fp = fopen(path, "wb");
-    if (!fp)
-        panic("Couldn't open %s: %s", path, strerror(errno));
-
-    png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, my_png_error_fn, NULL);
-    if (!png_ptr)
-        panic("png_create_write_struct() failed");
-    png_init_io(png_ptr, fp);
-    png_infop info_ptr = png_create_info_struct(png_ptr);
-    if (!info_ptr)
-        panic("png_create_info_struct() failed");
-    png_set_IHDR(png_ptr, info_ptr, width, height, 4, PNG_COLOR_TYPE_PALETTE,
-                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
-    png_set_PLTE(png_ptr, info_ptr, png_pal, ncolors);
-    png_set_rows(png_ptr, info_ptr, row_pointers);
-    if (comp_lvl != Z_DEFAULT_COMPRESSION)
-        png_set_compression_level(png_ptr, comp_lvl);
-    png_write_png(png_ptr, info_ptr, PNG_TRANSFORM_PACKING, NULL);
-    png_destroy_write_struct(&png_ptr, &info_ptr);
-
-    if (ferror(fp) || fclose(fp))
-        panic("Couldn't write %s", path);
+    png_writer_t *w = png_get_io_ptr(png_ptr);
+
+    if (w->size + length > w->max_size) {
+        size_t size = MAX(w->max_size * 2, w->size + length);
+        uint8_t *p = realloc(w->data, size);
+        if (!p)
+            out_of_memory();
+        w->data = p;
+        count_mem(size - w->max_size);
+        w->max_size = size;
+    }
+    memcpy(w->data + w->size, data, length);
+    w->size += length;
 }
 
-static void render_tiles(uint8_t *sgd_data, cairo_surface_t *mask)
+static void png_flush_fn(png_structp png_ptr)
 {
-    uint8_t *cr_data = cairo_image_surface_get_data(mask);
-    int cr_stride = cairo_format_stride_for_width(CAIRO_FORMAT_A8, sgd_width);
-    for (int i = 0; i < sgd_height; i++) {
-        int d = i / TILE_HEIGHT;
-        int m = i % TILE_HEIGHT;
-        uint8_t *dst = &sgd_data[i * sgd_width];
-        uint8_t *msk = &cr_data[i * cr_stride];
-        for (int j = 0; j < h_tiles; j++) {
-            int w = MIN(TILE_WIDTH, sgd_width - j * TILE_WIDTH);
-            uint8_t *src = &tiles[d * h_tiles + j][m * w];
-            for (int k = 0; k < w; k++, msk++)
-                *dst++ = *msk == 255 ? colormap[src[k]] : *msk >> 5;
-        }
-    }
+    (void)png_ptr;
 }
 
-static void apply_mask(uint8_t *sgd_data, cairo_surface_t *mask)
+/* deflate state of the encoder is pooled */
+static png_voidp png_malloc_fn(png_structp png_ptr, png_alloc_size_t size)
 {
-    uint8_t *cr_data = cairo_image_surface_get_data(mask);
-    int cr_stride = cairo_format_stride_for_width(CAIRO_FORMAT_A8, sgd_width);
-    for (int i = 0; i < sgd_height; i++) {
-        uint8_t *dst = &sgd_data[i * sgd_width];
-        uint8_t *msk = &cr_data[i * cr_stride];
-        for (int j = 0; j < sgd_width; j++, dst++, msk++)
-            if (*msk && (*dst != PAL_WHITE || *msk == 255))
-                *dst |= 8;
-    }
+    (void)png_ptr;
+    return pool_alloc(size);
 }
 
-static void write_full(uint8_t *sgd_data, const char *path, int ncolors)
+static void png_free_fn(png_structp png_ptr, png_voidp p)
 {
-    png_bytep row_pointers[MAX_HEIGHT];
-
-    for (int i = 0; i < sgd_height; i++)
-        row_pointers[i] = &sgd_data[i * sgd_width];
-
-    write_rows(path, row_pointers, sgd_width, sgd_height, ncolors);
+    (void)png_ptr;
+    pool_free(p);
 }
 
-static void write_crop(uint8_t *sgd_data, const char *path, const bounds_t *b)
+/*
+ * Release writer of an image not completed.
+ */
+static void free_png(void *arg)
 {
-    if (!bounds_empty(b)) {
-        png_bytep row_pointers[MAX_HEIGHT];
-        int w = b->max_x - b->min_x + 1;
-        int h = b->max_y - b->min_y + 1;
+    png_writer_t *w = arg;
 
-        for (int i = 0; i < h; i++)
-            row_pointers[i] = &sgd_data[(b->min_y + i) * sgd_width + b->min_x];
+    png_destroy_write_struct(&w->png_ptr, &w->info_ptr);
+    count_mem(-w->max_size);
+    free(w->data);
+    free(w->path);
+    *w = (png_writer_t){};
+}
 
-        write_rows(path, row_pointers, w, h, 16);
+/*
+ * Rows are passed one pixel to a byte, or two to a byte, high nibble
+ * first, when packed is set. With no colors, the image is 16 bit gray,
+ * passed as big-endian pairs of bytes.
+ */
+static void open_png(png_writer_t *w, const char *path, int width, int height, int ncolors, bool packed)
+{
+    *w = (png_writer_t){ .max_size = 0x10000 };
+    push_cleanup(free_png, w);
+    w->data = malloc(w->max_size);
+    w->path = strdup(path);
+    if (!w->data || !w->path)
+        out_of_memory();
+    count_mem(w->max_size);
+
+    w->png_ptr = png_create_write_struct_2(PNG_LIBPNG_VER_STRING, NULL, my_png_error_fn, NULL,
+                                           NULL, png_malloc_fn, png_free_fn);
+    if (!w->png_ptr)
+        panic("png_create_write_struct() failed");
+    png_set_write_fn(w->png_ptr, w, png_write_fn, png_flush_fn);
+    w->info_ptr = png_create_info_struct(w->png_ptr);
+    if (!w->info_ptr)
+        panic("png_create_info_struct() failed");
+    if (ncolors) {
+        png_set_IHDR(w->png_ptr, w->info_ptr, width, height, 4, PNG_COLOR_TYPE_PALETTE,
+                     PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+        png_set_PLTE(w->png_ptr, w->info_ptr, cur->png_pal, ncolors);
+    } else {
+        png_set_IHDR(w->png_ptr, w->info_ptr, width, height, 16, PNG_COLOR_TYPE_GRAY,
+                     PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+        packed = true;
     }
+    if (cur->opt.compression != Z_DEFAULT_COMPRESSION)
+        png_set_compression_level(w->png_ptr, cur->opt.compression);
+    png_write_info(w->png_ptr, w->info_ptr);
+    if (!packed)
+        png_set_packing(w->png_ptr);
+}
+
+static void write_png_rows(png_writer_t *w, uint8_t *data, int stride, int num_rows)
+{
+    for (int i = 0; i < num_rows; i++)
+        png_write_row(w->png_ptr, &data[(size_t)i * stride]);
 }
 
-static int do_full;
-static int do_crop;
+typedef struct {
+    uint8_t     *data;
+    size_t      size;
+    char        *path;
+} png_copy_t;
 
-static char *fixsep(char *s)
+static void write_output(const char *path, uint8_t *data, size_t size)
 {
-#ifdef _WIN32
-    char *p = s;
+    pthread_mutex_lock(&cur->sink_lock);
+    int err = cur->sink->write(cur->sink->opaque, path, data, size);
+    pthread_mutex_unlock(&cur->sink_lock);
 
-    while (*p) {
-        if (*p == '\\')
-            *p = '/';
-        p++;
-    }
-#endif
-    return s;
+    if (err)
+        fail(err, "Couldn't write %s: %s", path, strerror(err));
 }
 
-static void mkpath(char *s)
+/*
+ * Pass image to sink, keeping a copy of the encoded data and its path in
+ * keep, when given.
+ */
+static void close_png(png_writer_t *w, png_copy_t *keep)
 {
-    char *p = s;
+    png_write_end(w->png_ptr, w->info_ptr);
+    png_destroy_write_struct(&w->png_ptr, &w->info_ptr);
+
+    if (keep) {
+        keep->data = malloc(w->size);
+        keep->path = strdup(w->path);
+        if (!keep->data || !keep->path)
+            out_of_memory();
+        memcpy(keep->data, w->data, w->size);
+        keep->size = w->size;
+        count_mem(keep->size);
+    }
 
-    while (*p == '/')
-        p++;
+    /* data belongs to sink from here */
+    uint8_t *data = w->data;
+    count_mem(-w->max_size);
+    w->data = NULL;
+    w->max_size = 0;
+    write_output(w->path, data, w->size);
 
-    while ((p = strchr(p, '/'))) {
-        *p = 0;
-#ifdef _WIN32
-        _mkdir(s);
-#else
-        mkdir(s, 0755);
-#endif
-        *p++ = '/';
-    }
+    pop_cleanup(w, true);
 }
 
-static bool set_has_entry(SGDEntry *set, int index)
+static inline __attribute__((always_inline))
+void render_tiles_with(uint8_t *sgd_data, const uint8_t *cr_data, int cr_stride, int row, int num_rows,
+                       const int tw, const int th)
 {
-    for (int i = 0; i < set->set.num_entries; i++)
-        if (set->set.entries[i] == index)
-            return true;
-    return false;
-}
-
+    static uint8_t no_label[MAX_TILE_WIDTH] = { [0 ... MAX_TILE_WIDTH - 1] = 255 };
+
+    for (int i = 0; i < num_rows; i++) {
+        int d = i / th;
+        int m = i % th;
+        uint8_t *dst = &sgd_data[(size_t)i * cur->sgd_width];
+        const uint8_t *msk = &cr_data[(size_t)i * cr_stride];
+        for (int j = 0; j < cur->h_tiles; j++) {
+            int w = MIN(tw, cur->sgd_width - j * tw);
+            int t = (row + d) * cur->h_tiles + j;
+            if (cur->tile_fill[t] >= 0) {
+                if (!memcmp(msk, no_label, w)) {
+                    memset(dst, cur->colormap[cur->tile_fill[t]], w);
+                    dst += w;
+                    msk += w;
+                    continue;
+                }
+                cur->tile_color[t] = -1;
+                uint8_t c = cur->colormap[cur->tile_fill[t]];
+                for (int k = 0; k < w; k++, msk++)
+                    *dst++ = *msk == 255 ? c : *msk >> 5;
+                continue;
+            }
+            const uint8_t *src = &cur->tiles[(size_t)(d * cur->h_tiles + j) * tw * th + m * w];
+            for (int k = 0; k < w; k++, msk++)
+                *dst++ = *msk == 255 ? cur->colormap[src[k]] : *msk >> 5;
+        }
+    }
+}
+
+/*
+ * Compose num_rows rows of decoded tiles and labels into sgd_data. Strip
+ * starts at the first row of tiles. Common tile sizes get code of their
+ * own, where tile rows have constant length and divisions are shifts.
+ */
+static void render_tiles(uint8_t *sgd_data, cairo_surface_t *mask, int row, int num_rows)
+{
+    const uint8_t *cr_data = cairo_image_surface_get_data(mask);
+    int cr_stride = cairo_format_stride_for_width(CAIRO_FORMAT_A8, cur->sgd_width);
+
+    for (int i = row * cur->h_tiles; i < (row + (num_rows + cur->tile_h - 1) / cur->tile_h) * cur->h_tiles; i++)
+        cur->tile_color[i] = cur->tile_fill[i] >= 0 ? cur->colormap[cur->tile_fill[i]] : -1;
+
+    if (cur->tile_w == 128 && cur->tile_h == 128)
+        render_tiles_with(sgd_data, cr_data, cr_stride, row, num_rows, 128, 128);
+    else if (cur->tile_w == 64 && cur->tile_h == 64)
+        render_tiles_with(sgd_data, cr_data, cr_stride, row, num_rows, 64, 64);
+    else if (cur->tile_w == 256 && cur->tile_h == 256)
+        render_tiles_with(sgd_data, cr_data, cr_stride, row, num_rows, 256, 256);
+    else
+        render_tiles_with(sgd_data, cr_data, cr_stride, row, num_rows, cur->tile_w, cur->tile_h);
+}
+
+typedef struct {
+    int     x0, x1;
+    int     group;
+    int     cls;
+} span_t;
+
+#define SPAN_SHAPE  1
+#define SPAN_LABEL  2
+
+/*
+ * Coverage of set groups as horizontal runs of covered pixels of each
+ * image row, sorted by group and start column. x1 is exclusive.
+ */
+typedef struct cover_row {
+    span_t  *spans;
+    int     num_spans;
+    int     max_spans;
+} cover_row_t;
+
+static void add_span(cover_row_t *row, int group, int x0, int x1, int cls)
+{
+    if (row->num_spans == row->max_spans) {
+        int max_spans = row->max_spans ? row->max_spans * 2 : 8;
+        span_t *spans = realloc(row->spans, max_spans * sizeof(span_t));
+        if (!spans)
+            out_of_memory();
+        row->spans = spans;
+        count_mem((max_spans - row->max_spans) * sizeof(span_t));
+        row->max_spans = max_spans;
+    }
+    row->spans[row->num_spans++] = (span_t){ x0, x1, group, cls };
+}
+
+/*
+ * Append spans of group from the top left width by height pixels of mask
+ * surface, the first of which is image pixel (x, y).
+ */
+static void extract_spans(int group, cairo_surface_t *mask, int x, int y, int width, int height)
+{
+    uint8_t *cr_data = cairo_image_surface_get_data(mask);
+    int cr_stride = cairo_image_surface_get_stride(mask);
+    for (int i = 0; i < height; i++) {
+        uint8_t *msk = &cr_data[(size_t)i * cr_stride];
+        int j = 0;
+        while (j < width) {
+            if (!msk[j]) {
+                j++;
+                continue;
+            }
+            int cls = msk[j] == 255 ? SPAN_LABEL : SPAN_SHAPE;
+            int start = j;
+            while (j < width && msk[j] && (msk[j] == 255 ? SPAN_LABEL : SPAN_SHAPE) == cls)
+                j++;
+            add_span(&cur->cover[y + i], group, x + start, x + j, cls);
+        }
+    }
+}
+
+static void free_cover(void)
+{
+    if (!cur->cover)
+        return;
+    for (int y = 0; y < cur->sgd_height; y++) {
+        count_mem(-cur->cover[y].max_spans * sizeof(span_t));
+        free(cur->cover[y].spans);
+    }
+    count_mem(-cur->sgd_height * sizeof(cover_row_t));
+    free(cur->cover);
+    cur->cover = NULL;
+}
+
+/*
+ * Spans of group in row y overlapping columns [min_x, max_x], n set to
+ * their count.
+ */
+static const span_t *group_spans(int y, int group, int min_x, int max_x, int *n)
+{
+    const cover_row_t *row = &cur->cover[y];
+    int lo = 0, hi = row->num_spans;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        const span_t *s = &row->spans[mid];
+        if (s->group < group || (s->group == group && s->x1 <= min_x))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    int end = lo;
+    while (end < row->num_spans && row->spans[end].group == group && row->spans[end].x0 <= max_x)
+        end++;
+    *n = end - lo;
+    return &row->spans[lo];
+}
+
+/*
+ * Highlight pixels of group in rows [b->min_y, b->max_y] and columns
+ * [b->min_x, b->max_x] in sgd_data, which holds only that rectangle.
+ */
+static void apply_mask(uint8_t *sgd_data, int group, const bounds_t *b)
+{
+    int w = b->max_x - b->min_x + 1;
+    for (int y = b->min_y; y <= b->max_y; y++) {
+        int n;
+        const span_t *s = group_spans(y, group, b->min_x, b->max_x, &n);
+        uint8_t *dst = &sgd_data[(size_t)(y - b->min_y) * w - b->min_x];
+        int16_t *color = &cur->tile_color[y / cur->tile_h * cur->h_tiles];
+        for (; n--; s++) {
+            int x0 = MAX(s->x0, b->min_x);
+            int x1 = MIN(s->x1, b->max_x + 1);
+            if (s->cls == SPAN_LABEL) {
+                for (int j = x0; j < x1; j++)
+                    dst[j] |= 8;
+                continue;
+            }
+            /* shape spans leave white alone, so whole white tiles can be skipped */
+            while (x0 < x1) {
+                int t = x0 / cur->tile_w;
+                int end = MIN(x1, (t + 1) * cur->tile_w);
+                if (color[t] == PAL_WHITE) {
+                    /* nothing to highlight */
+                } else if (color[t] >= 0) {
+                    memset(&dst[x0], color[t] | 8, end - x0);
+                } else {
+                    for (int j = x0; j < end; j++)
+                        if (dst[j] != PAL_WHITE)
+                            dst[j] |= 8;
+                }
+                x0 = end;
+            }
+        }
+    }
+}
+
+/*
+ * Copy rectangle r of strip starting at image row strip_y to dst and
+ * highlight pixels covered by group.
+ */
+static void compose_rows(uint8_t *dst, const uint8_t *strip, int strip_y, int group, const bounds_t *r)
+{
+    int w = r->max_x - r->min_x + 1;
+
+    for (int y = r->min_y; y <= r->max_y; y++)
+        memcpy(&dst[(size_t)(y - r->min_y) * w], &strip[(size_t)(y - strip_y) * cur->sgd_width + r->min_x], w);
+
+    apply_mask(dst, group, r);
+}
+
+/*
+ * Highlight pixels [x0, x1) of a packed row, all of them or those not
+ * white.
+ */
+static void highlight_packed(uint8_t *row, int x0, int x1, bool all)
+{
+    uint8_t *p = &row[x0 / 2];
+
+    if (x0 & 1) {
+        if (all || (*p & 0x0f) != PAL_WHITE)
+            *p |= 0x08;
+        p++;
+        x0++;
+    }
+
+    if (all) {
+        for (; x0 + 2 <= x1; x0 += 2)
+            *p++ |= 0x88;
+    } else {
+        for (; x0 + 2 <= x1; x0 += 2, p++)
+            *p |= ((*p & 0xf0) != PAL_WHITE << 4) << 7 | ((*p & 0x0f) != PAL_WHITE) << 3;
+    }
+
+    if (x0 < x1 && (all || *p >> 4 != PAL_WHITE))
+        *p |= 0x80;
+}
+
+/*
+ * Like compose_rows(), but pack pixels two to a byte for PNG, row by row
+ * in one pass with highlighting. Rows of dst are (width + 1) / 2 bytes,
+ * an odd last pixel padded with zero as libpng does.
+ */
+static void compose_packed(uint8_t *dst, const uint8_t *strip, int strip_y, int group, const bounds_t *r)
+{
+    int w = r->max_x - r->min_x + 1;
+    int stride = (w + 1) / 2;
+
+    for (int y = r->min_y; y <= r->max_y; y++) {
+        const uint8_t *src = &strip[(size_t)(y - strip_y) * cur->sgd_width + r->min_x];
+        uint8_t *row = &dst[(size_t)(y - r->min_y) * stride];
+
+        for (int x = 0; x < w / 2; x++)
+            row[x] = src[2 * x] << 4 | src[2 * x + 1];
+        if (w & 1)
+            row[w / 2] = src[w - 1] << 4;
+
+        int16_t *color = &cur->tile_color[y / cur->tile_h * cur->h_tiles];
+        int n;
+        for (const span_t *s = group_spans(y, group, r->min_x, r->max_x, &n); n--; s++) {
+            int x0 = MAX(s->x0, r->min_x);
+            int x1 = MIN(s->x1, r->max_x + 1);
+            if (s->cls == SPAN_LABEL) {
+                if (x0 < x1)
+                    highlight_packed(row, x0 - r->min_x, x1 - r->min_x, true);
+                continue;
+            }
+            while (x0 < x1) {
+                int t = x0 / cur->tile_w;
+                int end = MIN(x1, (t + 1) * cur->tile_w);
+                if (color[t] != PAL_WHITE)
+                    highlight_packed(row, x0 - r->min_x, end - r->min_x, color[t] >= 0);
+                x0 = end;
+            }
+        }
+    }
+}
+
+/*
+ * Match name against pattern with * and ? wildcards, ignoring case.
+ */
+static bool match_name(const char *pat, const char *name)
+{
+    for (; *pat; pat++, name++) {
+        if (*pat == '*') {
+            for (const char *p = name; ; p++) {
+                if (match_name(pat + 1, p))
+                    return true;
+                if (!*p)
+                    return false;
+            }
+        }
+        if (!*name || (*pat != '?' && toupper((unsigned char)*pat) != toupper((unsigned char)*name)))
+            return false;
+    }
+    return !*name;
+}
+
+static bool set_selected(const char *name)
+{
+    if (!cur->opt.sets)
+        return true;
+    for (int i = 0; i < cur->opt.num_sets; i++)
+        if (match_name(cur->opt.sets[i], name))
+            return true;
+    return false;
+}
+
+static bool set_has_entry(SGDEntry *set, int index)
+{
+    for (int i = 0; i < set->set.num_entries; i++)
+        if (set->set.entries[i] == index)
+            return true;
+    return false;
+}
+
 static bool set_is_subset(SGDEntry *set)
 {
-    for (int i = 0; i < dir->num_entries; i++) {
-        SGDEntry *e = (SGDEntry *)(base_off + dir->addr[i]);
+    for (int i = 0; i < cur->dir->num_entries; i++) {
+        SGDEntry *e = (SGDEntry *)(base_off() + cur->dir->addr[i]);
         if (e == set || e->hdr.type != SGD_SET || e->set.num_entries <= set->set.num_entries)
             continue;
         int j;
@@ -833,8 +1786,10 @@ static void clearstr(char *out, size_t size, const char *in)
 
 static char *get_set_name_buf(char *buf, size_t size, SGDEntry *set)
 {
+    const uint32_t *entries = set_entries(set);
+
     for (int i = 0; i < set->set.num_entries; i++) {
-        SGDEntry *e = find_entry(set->set.entries[i]);
+        SGDEntry *e = find_entry(entries[i]);
         if (e->hdr.type == SGD_TEXTLINE2D && !strchr(e->textline.text, '-')) {
             clearstr(buf, size, e->textline.text);
             if (*buf)
@@ -848,10 +1803,12 @@ static char *get_set_name_buf(char *buf, size_t size, SGDEntry *set)
 
 static void finalize_bounds(bounds_t *b, SGDEntry *set)
 {
+    const uint32_t *entries = set_entries(set);
+
     if (bounds_empty(b)) {
         for (int i = 0; i < (int)set->set.num_entries-1; i++) {
-            SGDEntry *e = find_entry(set->set.entries[i]);
-            SGDEntry *n = find_entry(set->set.entries[i+1]);
+            SGDEntry *e = find_entry(entries[i]);
+            SGDEntry *n = find_entry(entries[i+1]);
             if (e->hdr.type == SGD_TEXTLINE2D && !strchr(e->textline.text, '-') && n->hdr.type == SGD_SIMPLEAREA) {
                 calc_entry_bounds(b, n);
                 break;
@@ -861,305 +1818,2292 @@ static void finalize_bounds(bounds_t *b, SGDEntry *set)
     expand_bounds(b);
 }
 
-static void process_sets(const uint8_t *backgr, const char *path)
+/*
+ * Output image of a set group. Images identical to one of an earlier
+ * group are not encoded again, and the earlier one keeps its encoded data
+ * for them.
+ */
+typedef struct {
+    int         dup_of;
+    bool        keep;
+    png_copy_t  copy;
+} set_image_t;
+
+typedef struct set_group {
+    SGDEntry    *set;
+    SGDEntry    **members;
+    int         num_members;
+    char        name[16];
+    bounds_t    bounds;
+    /* bounds of the sets, before margin and label fallback of the crop */
+    bounds_t    set_bounds;
+    /* pixels the group is rasterised over */
+    bounds_t    extent;
+    uint32_t    hash;
+    set_image_t full;
+    set_image_t crop;
+} set_group_t;
+
+/*
+ * Call fn(arg) with cur set to f. Returns 0, or negative errno value
+ * passed to fail() during the call.
+ */
+static int run_protected(sgd_file *f, void (*fn)(void *), void *arg)
 {
-    char buf[1024];
-    size_t size = sgd_width * sgd_height;
-    uint8_t *data = malloc(size);
+    sgd_file *saved = cur;
+    jmp_buf *saved_jmp = panic_jmp;
+    int saved_depth = cleanup_depth;
+    jmp_buf jmp;
+    int err = 0;
+
+    cur = f;
+    panic_jmp = &jmp;
+    cleanup_depth = num_cleanups;
+    if (!setjmp(jmp))
+        fn(arg);
+    else
+        err = -last_errno;
+    cur = saved;
+    panic_jmp = saved_jmp;
+    cleanup_depth = saved_depth;
 
-    char *p = strrchr(path, '/');
-    if (!p)
-        panic("Bad path");
-    *p = 0;
-    char *name = p + 1;
+    return err;
+}
 
-    if (do_full) {
-        s_snprintf(buf, sizeof(buf), "%s/full/", path);
-        mkpath(buf);
-    }
+typedef struct {
+    sgd_file    *f;
+    void        (*fn)(void *);
+    void        *arg;
+} job_thread_t;
 
-    if (do_crop) {
-        s_snprintf(buf, sizeof(buf), "%s/crop/", path);
-        mkpath(buf);
+static void *job_thread(void *p)
+{
+    job_thread_t *t = p;
+
+    int err = run_protected(t->f, t->fn, t->arg);
+    if (err) {
+        pthread_mutex_lock(&t->f->job_lock);
+        if (!t->f->job_error) {
+            t->f->job_error = -err;
+            strcpy(t->f->job_msg, last_error);
+        }
+        pthread_mutex_unlock(&t->f->job_lock);
     }
 
-    cairo_surface_t *mask = cairo_image_surface_create(CAIRO_FORMAT_A8, sgd_width, sgd_height);
+    return NULL;
+}
+
+/*
+ * Run fn(arg) in num_jobs threads, the calling thread being one of them.
+ * Work is shared out by fn itself, see next_job(). The first error of any
+ * thread is raised again once all have finished.
+ */
+static void run_jobs(void (*fn)(void *), void *arg)
+{
+    pthread_t threads[cur->opt.jobs];
+    job_thread_t t = { cur, fn, arg };
+    int n = 1;
 
-    cairo_t *mask_cr = cairo_create(mask);
-    cairo_set_antialias(mask_cr, CAIRO_ANTIALIAS_NONE);
-    cairo_set_operator(mask_cr, CAIRO_OPERATOR_SOURCE);
-    cairo_set_fill_rule(mask_cr, CAIRO_FILL_RULE_EVEN_ODD);
+    cur->job_error = 0;
 
-    for (int i = 0; i < dir->num_entries; i++) {
-        SGDEntry *e = (SGDEntry *)(base_off + dir->addr[i]);
-        if (e->hdr.type != SGD_SET || e->set.unk7 & SET_DRAWN || set_is_subset(e))
-            continue;
+    for (; n < cur->opt.jobs; n++)
+        if (pthread_create(&threads[n], NULL, job_thread, &t))
+            break;
 
-        char *text = get_set_name(e);
-        if (!text)
-            continue;
+    job_thread(&t);
 
-        bounds_t b = EMPTY_BOUNDS;
+    for (int i = 1; i < n; i++)
+        pthread_join(threads[i], NULL);
 
-        set_color(mask_cr, COLOR_HOLE);
-        cairo_paint(mask_cr);
+    if (cur->job_error)
+        fail(cur->job_error, "%s", cur->job_msg);
+}
 
-        render_mask_r(mask_cr, e);
+/*
+ * Claim next job, or none once a thread has failed.
+ */
+static int next_job(int *counter)
+{
+    if (__atomic_load_n(&cur->job_error, __ATOMIC_RELAXED))
+        return INT_MAX;
+    return __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+}
 
-        if (do_crop)
-            calc_set_bounds_r(&b, e);
+/*
+ * With encoder threads, rows of the base image and of set images are
+ * queued for encoding, and rendering goes on with later rows and images.
+ * Chunks of rows are encoded in order of queueing, those of one image by
+ * one thread at a time. Queued rows, and a writer buffer for each image
+ * not yet encoded, count against ENCODE_QUEUE_SIZE bytes per thread.
+ * Renderers wait for room while the queue is full. Without encoder
+ * threads, rows are encoded as they are passed.
+ */
+#define ENCODE_CHUNK_SIZE   (256 << 10)
+#define ENCODE_QUEUE_SIZE   (4 * ENCODE_CHUNK_SIZE)
+#define ENCODE_IMAGE_SIZE   0x10000
+
+typedef struct image {
+    png_copy_t      *keep;
+    png_writer_t    png;
+    /* buffer of image_rows(), kept for the next rows without encoder threads */
+    uint8_t         *rows;
+    size_t          rows_size;
+    bool            busy;
+    struct image    *next;
+} image_t;
 
-        e->set.unk7 |= SET_DRAWN;
+/*
+ * Rows owned by a chunk are counted in size. Other rows are borrowed
+ * from the renderer. A chunk without rows closes its image.
+ */
+typedef struct chunk {
+    image_t         *img;
+    uint8_t         *data;
+    size_t          size;
+    int             stride;
+    int             num_rows;
+    struct chunk    *next;
+} chunk_t;
+
+typedef struct encoder {
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    pthread_t       *threads;
+    int             num_threads;
+    chunk_t         *head;
+    chunk_t         **tail;
+    /* all images, released when stopping */
+    image_t         *images;
+    size_t          queued;
+    size_t          max_queued;
+    int             active;
+    bool            stop;
+    /* first error in an encoder thread */
+    int             error;
+    char            msg[256];
+} encoder_t;
+
+static void free_chunk(void *arg)
+{
+    chunk_t *c = arg;
 
-        for (int j = i + 1; j < dir->num_entries; j++) {
-            SGDEntry *e2 = (SGDEntry *)(base_off + dir->addr[j]);
-            if (e2->hdr.type != SGD_SET || e2->set.unk7 & SET_DRAWN || set_is_subset(e2))
-                continue;
+    if (c->size) {
+        pool_free(c->data);
+        count_mem(-c->size);
+    }
+    free(c);
+}
 
-            char *text2 = get_set_name(e2);
-            if (!text2 || strcmp(text2, text))
-                continue;
+static void free_image(void *arg)
+{
+    image_t *img = arg;
 
-            render_mask_r(mask_cr, e2);
+    free_png(&img->png);
+    if (img->rows) {
+        pool_free(img->rows);
+        count_mem(-img->rows_size);
+    }
+    free(img);
+}
 
-            if (do_crop)
-                calc_set_bounds_r(&b, e2);
+static void encode_chunk(chunk_t *c)
+{
+    image_t *img = c->img;
 
-            e2->set.unk7 |= SET_DRAWN;
-        }
+    push_cleanup(free_chunk, c);
+    push_cleanup(free_png, &img->png);
+    if (c->data) {
+        write_png_rows(&img->png, c->data, c->stride, c->num_rows);
+        pop_cleanup(&img->png, false);
+    } else {
+        close_png(&img->png, img->keep);
+    }
+    pop_cleanup(c, true);
+}
 
-        cairo_surface_flush(mask);
+/*
+ * Encode chunks as they come, until stopped.
+ */
+static void encode_chunks(void *arg)
+{
+    encoder_t *e = arg;
 
-        memcpy(data, backgr, size);
-        apply_mask(data, mask);
+    pthread_mutex_lock(&e->lock);
+    while (!e->error && !e->stop) {
+        chunk_t **p = &e->head;
+        while (*p && (*p)->img->busy)
+            p = &(*p)->next;
 
-        if (do_full) {
-            s_snprintf(buf, sizeof(buf), "%s/full/%s_%s.png", path, name, text);
-            write_full(data, buf, 16);
+        chunk_t *c = *p;
+        if (!c) {
+            pthread_cond_wait(&e->cond, &e->lock);
+            continue;
         }
+        if (!(*p = c->next))
+            e->tail = p;
+        c->img->busy = true;
+        e->active++;
+        pthread_mutex_unlock(&e->lock);
+
+        image_t *img = c->img;
+        size_t size = c->data ? c->size : ENCODE_IMAGE_SIZE;
+        encode_chunk(c);
+
+        pthread_mutex_lock(&e->lock);
+        img->busy = false;
+        e->active--;
+        e->queued -= size;
+        pthread_cond_broadcast(&e->cond);
+    }
+    pthread_mutex_unlock(&e->lock);
+}
 
-        if (do_crop) {
-            finalize_bounds(&b, e);
-            s_snprintf(buf, sizeof(buf), "%s/crop/%s_%s.png", path, name, text);
-            write_crop(data, buf, &b);
+static void *encoder_thread(void *p)
+{
+    sgd_file *f = p;
+    encoder_t *e = f->encoder;
+
+    int err = run_protected(f, encode_chunks, e);
+    if (err) {
+        pthread_mutex_lock(&e->lock);
+        if (!e->error) {
+            e->error = -err;
+            strcpy(e->msg, last_error);
         }
+        pthread_cond_broadcast(&e->cond);
+        pthread_mutex_unlock(&e->lock);
     }
 
-    cairo_destroy(mask_cr);
-    cairo_surface_destroy(mask);
-
-    free(data);
+    return NULL;
 }
 
-static void write_png(const char *path)
+/*
+ * Stop encoder threads, dropping what is left in the queue.
+ */
+static void stop_encoders(void *arg)
 {
-    size_t size = sgd_width * sgd_height;
-    uint8_t *backgr = malloc(size);
-
-    cairo_surface_t *mask = render_labels();
-    render_tiles(backgr, mask);
-    cairo_surface_destroy(mask);
+    encoder_t *e = arg;
 
-    char *p = strrchr(path, '/');
-    if (p && (p = strrchr(p + 1, '.')))
-        *p = 0;
+    pthread_mutex_lock(&e->lock);
+    e->stop = true;
+    pthread_cond_broadcast(&e->cond);
+    pthread_mutex_unlock(&e->lock);
 
-    char buf[1024];
-    s_snprintf(buf, sizeof(buf), "%s.png", path);
-    mkpath(buf);
-    write_full(backgr, buf, 8);
+    for (int i = 0; i < e->num_threads; i++)
+        pthread_join(e->threads[i], NULL);
 
-    if (do_full || do_crop)
-        process_sets(backgr, path);
+    while (e->head) {
+        chunk_t *c = e->head;
+        e->head = c->next;
+        free_chunk(c);
+    }
+    while (e->images) {
+        image_t *img = e->images;
+        e->images = img->next;
+        free_image(img);
+    }
 
-    free(backgr);
-    cur_fn = NULL;
+    pthread_cond_destroy(&e->cond);
+    pthread_mutex_destroy(&e->lock);
+    free(e->threads);
+    free(e);
+    cur->encoder = NULL;
 }
 
-static void uncompress_zgd(FILE *fp)
+static void start_encoders(void)
 {
-    z_stream z = {
-        .next_out  = base,
-        .avail_out = MAX_BASE
-    };
+    encoder_t *e = calloc(1, sizeof(*e));
+    if (!e)
+        out_of_memory();
+    e->tail = &e->head;
+    e->max_queued = (size_t)cur->opt.encoders * ENCODE_QUEUE_SIZE;
+    pthread_mutex_init(&e->lock, NULL);
+    pthread_cond_init(&e->cond, NULL);
+    cur->encoder = e;
+    push_cleanup(stop_encoders, e);
+
+    if (!(e->threads = malloc(cur->opt.encoders * sizeof(pthread_t))))
+        out_of_memory();
+    for (; e->num_threads < cur->opt.encoders; e->num_threads++)
+        if (pthread_create(&e->threads[e->num_threads], NULL, encoder_thread, cur))
+            break;
 
-    if (inflateInit2(&z, 32 + 15))
-        panic("inflateInit() failed");
+    /* encode in place if no thread could be started */
+    if (!e->num_threads)
+        pop_cleanup(e, true);
+}
 
-    while (1) {
-        uint8_t buf[0x10000];
-        z.next_in  = buf;
-        z.avail_in = fread(buf, 1, sizeof(buf), fp);
-        if (!z.avail_in)
-            panic("Partial file");
-        int res = inflate(&z, Z_NO_FLUSH);
-        if (res == Z_STREAM_END)
-            break;
-        if (res != Z_OK)
-            panic("inflate() failed with %d", res);
-    }
+/*
+ * Wait until all queued images are encoded. Raises the error of a failed
+ * encoder thread.
+ */
+static void wait_encoders(void)
+{
+    encoder_t *e = cur->encoder;
+    if (!e)
+        return;
+
+    pthread_mutex_lock(&e->lock);
+    while (!e->error && (e->head || e->active))
+        pthread_cond_wait(&e->cond, &e->lock);
+    int err = e->error;
+    pthread_mutex_unlock(&e->lock);
+
+    if (err)
+        fail(err, "%s", e->msg);
+}
+
+/*
+ * Take size bytes of queue space, waiting while the queue is full. An
+ * empty queue takes anything, so that renderers never wait on each other.
+ */
+static void reserve_queue(encoder_t *e, size_t size)
+{
+    pthread_mutex_lock(&e->lock);
+    while (!e->error && e->queued + size > e->max_queued && (e->head || e->active))
+        pthread_cond_wait(&e->cond, &e->lock);
+    int err = e->error;
+    if (!err)
+        e->queued += size;
+    pthread_mutex_unlock(&e->lock);
+
+    if (err)
+        fail(err, "%s", e->msg);
+}
 
-    file_size = z.total_out;
-    inflateEnd(&z);
+static void queue_chunk(encoder_t *e, chunk_t *c)
+{
+    pthread_mutex_lock(&e->lock);
+    *e->tail = c;
+    e->tail = &c->next;
+    pthread_cond_signal(&e->cond);
+    pthread_mutex_unlock(&e->lock);
 }
 
-static void load_sgd(const char *path)
+/*
+ * Start PNG image, see open_png(). Encoded data is passed to the sink
+ * with a copy kept in keep, when given, by close_image() or, with encoder
+ * threads, by the time wait_encoders() returns.
+ */
+static image_t *open_image(const char *path, int width, int height, int ncolors, bool packed, png_copy_t *keep)
 {
-    FILE *fp = fopen(path, "rb");
-    if (!fp)
-        panic("Couldn't open %s: %s", path, strerror(errno));
+    encoder_t *e = cur->encoder;
+
+    if (e)
+        reserve_queue(e, ENCODE_IMAGE_SIZE);
 
-    cur_fn = path;
+    image_t *img = calloc(1, sizeof(*img));
+    if (!img)
+        out_of_memory();
+    img->keep = keep;
 
-    uint32_t hdr;
-    if (fread(&hdr, 1, sizeof(hdr), fp) != sizeof(hdr) || fseek(fp, 0, SEEK_SET))
-        panic("Couldn't read header");
-    if ((hdr & 0xe0ffffff) == 0x00088b1f) {
-        uncompress_zgd(fp);
+    if (e) {
+        pthread_mutex_lock(&e->lock);
+        img->next = e->images;
+        e->images = img;
+        pthread_mutex_unlock(&e->lock);
     } else {
-        file_size = fread(base, 1, MAX_BASE + 1, fp);
-        if (file_size == MAX_BASE + 1)
-            panic("SGD file too big");
+        push_cleanup(free_image, img);
     }
 
-    fclose(fp);
-
-    if (file_size < SGD_OFFSET)
-        panic("SGD file too small");
+    open_png(&img->png, path, width, height, ncolors, packed);
+    /* writer belongs to the encoder threads from here */
+    if (e)
+        pop_cleanup(&img->png, false);
 
-    parse_header();
+    return img;
 }
 
-static char *dest_dir = ".";
-
-static void process_files(int argc, char **argv)
+/*
+ * Buffer for size bytes of rows, passed next to write_image_rows().
+ */
+static uint8_t *image_rows(image_t *img, size_t size)
 {
-    for (int i = 0; i < argc; i++) {
-        char *s = fixsep(argv[i]);
-        load_sgd(s);
-
-        char *p = strrchr(s, '/');
-        if (p)
-            s = p + 1;
+    encoder_t *e = cur->encoder;
 
-        char buf[1024];
-        s_snprintf(buf, sizeof(buf), "%s/%s", dest_dir, s);
+    if (e)
+        reserve_queue(e, size);
+    else if (img->rows && img->rows_size >= size)
+        return img->rows;
 
-        if (strlen(s) >= 3)
-            for (p = buf; (p = strstr(p, "###")); p += 3)
-                memcpy(p, s, 3);
-
-        write_png(buf);
+    if (img->rows) {
+        pool_free(img->rows);
+        count_mem(-img->rows_size);
     }
+    img->rows = pool_alloc(size);
+    img->rows_size = img->rows ? size : 0;
+    if (!img->rows)
+        out_of_memory();
+    count_mem(size);
+
+    return img->rows;
 }
 
-static bool is_white(const char *s)
+/*
+ * Pass rows, from image_rows() or borrowed. Borrowed rows must stay
+ * unchanged until wait_encoders() returns.
+ */
+static void write_image_rows(image_t *img, const uint8_t *data, int stride, int num_rows)
 {
-    while (*s) {
-        if (*s > ' ')
-            return false;
-        s++;
+    encoder_t *e = cur->encoder;
+
+    if (!e) {
+        write_png_rows(&img->png, (uint8_t *)data, stride, num_rows);
+        return;
     }
-    return true;
+
+    chunk_t *c = malloc(sizeof(*c));
+    if (!c)
+        out_of_memory();
+    *c = (chunk_t){ img, (uint8_t *)data, 0, stride, num_rows, NULL };
+    if (data == img->rows) {
+        c->size = img->rows_size;
+        img->rows = NULL;
+        img->rows_size = 0;
+    }
+    queue_chunk(e, c);
 }
 
-static void parse_pal_file(const char *path)
+/*
+ * Like write_image_rows() with rows that change after the call.
+ */
+static void copy_image_rows(image_t *img, const uint8_t *data, int stride, int num_rows)
 {
-    FILE *fp = fopen(path, "r");
-    if (!fp)
-        panic("Couldn't open %s: %s", path, strerror(errno));
-
-    int i = 0;
-    int j = 0;
-    char buf[1024];
-    while (fgets(buf, sizeof(buf), fp)) {
-        j++;
-        if (is_white(buf))
-            continue;
-        int r, g, b;
-        if (sscanf(buf, "%x %x %x", &r, &g, &b) != 3)
-            panic("Error at line %d in palette file", j);
-        if (i == 16)
-            panic("Too many colors in palette file");
-        png_pal[i].red = r;
-        png_pal[i].green = g;
-        png_pal[i].blue = b;
-        i++;
-    }
-
-    if (i == 8) {
-        for (i = 0; i < 8; i++) {
-            png_pal[i + 8] = png_pal[i];
-            png_pal[i + 8].blue = 0;
-        }
-    } else if (i != 16) {
-        panic("Palette file must contain 8 or 16 colors");
+    if (!cur->encoder) {
+        write_image_rows(img, data, stride, num_rows);
+        return;
     }
 
-    fclose(fp);
+    int chunk_rows = MAX(1, ENCODE_CHUNK_SIZE / stride);
+    for (int i = 0; i < num_rows; i += chunk_rows) {
+        int n = MIN(chunk_rows, num_rows - i);
+        uint8_t *rows = image_rows(img, (size_t)n * stride);
+        memcpy(rows, &data[(size_t)i * stride], (size_t)n * stride);
+        write_image_rows(img, rows, stride, n);
+    }
 }
 
-static void set_default_pal(void)
+static void close_image(image_t *img)
 {
-    for (int i = 0; i < 8; i++) {
-        png_pal[i] = png_pal[i + 8] = sgd_pal[i];
-        png_pal[i + 8].blue = 0;
+    encoder_t *e = cur->encoder;
+
+    if (!e) {
+        close_png(&img->png, img->keep);
+        pop_cleanup(img, true);
+        return;
     }
+
+    chunk_t *c = calloc(1, sizeof(*c));
+    if (!c)
+        out_of_memory();
+    c->img = img;
+    queue_chunk(e, c);
 }
 
-static void print_help(char **argv)
+static void add_group_member(set_group_t *g, SGDEntry *e)
 {
-    fprintf(stderr, "Usage: %s [options] <SGD-file> [...]\n", argv[0]);
-    fprintf(stderr, "Supported options:\n");
-    fprintf(stderr, "-c         also output cropped pictures of each selection set\n");
-    fprintf(stderr, "-f         also output full pictures of each selection set\n");
-    fprintf(stderr, "-p <file>  load alternative 8 or 16 color palette from file\n");
-    fprintf(stderr, "-z <0-9>   set PNG compression level\n");
-    fprintf(stderr, "-o <path>  set destination directory\n");
-    fprintf(stderr, "-h         show this help message\n");
-    exit(0);
+    SGDEntry **members = realloc(g->members, (g->num_members + 1) * sizeof(SGDEntry *));
+    if (!members)
+        out_of_memory();
+    g->members = members;
+    g->members[g->num_members++] = e;
 }
 
-int main(int argc, char **argv)
+/*
+ * Group top-level named sets by name. This reorders set entries, so it
+ * runs when the file is opened, before any parallel work.
+ */
+static void collect_groups(void)
 {
-    char *pal_file = NULL;
-    int opt;
+    bool *drawn = calloc(cur->dir->num_entries, sizeof(bool));
+    if (!drawn)
+        out_of_memory();
+    push_cleanup(free, drawn);
+
+    for (int i = 0; i < cur->dir->num_entries; i++) {
+        SGDEntry *e = (SGDEntry *)(base_off() + cur->dir->addr[i]);
+        if (e->hdr.type != SGD_SET || drawn[i] || set_is_subset(e))
+            continue;
 
-    while ((opt = getopt(argc, argv, "cfp:z:o:h")) != -1) {
-        switch (opt) {
-        case 'c':
-            do_crop = 1;
-            break;
-        case 'f':
-            do_full = 1;
-            break;
-        case 'p':
-            pal_file = optarg;
-            break;
-        case 'z':
-            comp_lvl = atoi(optarg);
-            break;
-        case 'o':
-            dest_dir = fixsep(optarg);
-            break;
-        default:
-            print_help(argv);
-            break;
-        }
-    }
+        char *text = get_set_name(e);
+        if (!text || !set_selected(text))
+            continue;
 
-    if (optind >= argc)
-        print_help(argv);
+        set_group_t *groups = realloc(cur->groups, (cur->num_groups + 1) * sizeof(*groups));
+        if (!groups)
+            out_of_memory();
+        cur->groups = groups;
+        set_group_t *g = &groups[cur->num_groups++];
+        *g = (set_group_t){ .set = e, .bounds = EMPTY_BOUNDS, .set_bounds = EMPTY_BOUNDS };
+        strcpy(g->name, text);
 
-    if (comp_lvl < Z_DEFAULT_COMPRESSION || comp_lvl > Z_BEST_COMPRESSION)
-        panic("Bad PNG compression level");
+        add_group_member(g, e);
 
-    if (pal_file)
-        parse_pal_file(pal_file);
-    else
-        set_default_pal();
+        if (cur->opt.crop_images)
+            calc_set_bounds_r(&g->bounds, e);
 
-    process_files(argc - optind, argv + optind);
+        drawn[i] = true;
 
-    return 0;
+        for (int j = i + 1; j < cur->dir->num_entries; j++) {
+            SGDEntry *e2 = (SGDEntry *)(base_off() + cur->dir->addr[j]);
+            if (e2->hdr.type != SGD_SET || drawn[j] || set_is_subset(e2))
+                continue;
+
+            char *text2 = get_set_name(e2);
+            if (!text2 || strcmp(text2, text))
+                continue;
+
+            add_group_member(g, e2);
+
+            if (cur->opt.crop_images)
+                calc_set_bounds_r(&g->bounds, e2);
+
+            drawn[j] = true;
+        }
+
+        if (cur->opt.crop_images) {
+            g->set_bounds = g->bounds;
+            finalize_bounds(&g->bounds, e);
+        }
+    }
+
+    pop_cleanup(drawn, true);
+}
+
+typedef struct {
+    set_group_t *groups;
+    int         num_groups;
+    int         next;
+    uint8_t     *backgr;
+    const char  *name;
+} set_job_t;
+
+/*
+ * A8 surface groups are filled on, grown as needed and used in part.
+ */
+typedef struct {
+    cairo_surface_t *surface;
+    cairo_t         *cr;
+} canvas_t;
+
+static void free_canvas(void *arg)
+{
+    canvas_t *c = arg;
+
+    if (c->surface) {
+        cairo_destroy(c->cr);
+        destroy_mask_surface(c->surface);
+    }
+    *c = (canvas_t){};
+}
+
+static void calc_mask_bounds_r(bounds_t *b, SGDEntry *set)
+{
+    for (int i = 0; i < set->set.num_entries; i++) {
+        SGDEntry *e = find_entry(set->set.entries[i]);
+        if (e->hdr.type == SGD_SET)
+            calc_mask_bounds_r(b, e);
+        else
+            calc_entry_bounds(b, e);
+    }
+}
+
+/*
+ * Pixels the mask of group may cover, within the image.
+ */
+static bounds_t mask_bounds(const set_group_t *g)
+{
+    bounds_t b = EMPTY_BOUNDS;
+
+    for (int k = 0; k < g->num_members; k++)
+        calc_mask_bounds_r(&b, g->members[k]);
+
+    /* points are rounded when drawn, but truncated here */
+    return (bounds_t){ MAX(b.min_x, 1) - 1, MAX(b.min_y, 1) - 1,
+                       MIN(b.max_x, cur->sgd_width - 2) + 1, MIN(b.max_y, cur->sgd_height - 2) + 1 };
+}
+
+/*
+ * Uncover the top left width by height pixels of mask.
+ */
+static void clear_mask(cairo_surface_t *mask, int width, int height)
+{
+    uint8_t *data = cairo_image_surface_get_data(mask);
+    int stride = cairo_image_surface_get_stride(mask);
+
+    cairo_surface_flush(mask);
+    for (int i = 0; i < height; i++)
+        memset(&data[(size_t)i * stride], 0, width);
+    cairo_surface_mark_dirty(mask);
+}
+
+/*
+ * Coverage of all groups is rasterised in one pass over the image, a band
+ * of rows at a time, each band by one thread. cairo fills each group of a
+ * band in turn, and its runs are added to the rows of the band with the
+ * group id, so runs of a row come out sorted by group.
+ */
+typedef struct {
+    int         first;
+    int         num;
+    int         band_rows;
+    int         next;
+} cover_job_t;
+
+static void render_bands(void *arg)
+{
+    cover_job_t *job = arg;
+    canvas_t canvas = {};
+    int num_bands = (cur->sgd_height + job->band_rows - 1) / job->band_rows;
+
+    push_cleanup(free_canvas, &canvas);
+
+    for (int k; (k = next_job(&job->next)) < num_bands; ) {
+        int y0 = k * job->band_rows;
+        int y1 = MIN(y0 + job->band_rows, cur->sgd_height) - 1;
+
+        for (int i = job->first; i < job->first + job->num; i++) {
+            set_group_t *g = &cur->groups[i];
+            bounds_t r = g->extent;
+
+            r.min_y = MAX(r.min_y, y0);
+            r.max_y = MIN(r.max_y, y1);
+            if (bounds_empty(&r))
+                continue;
+
+            int width = r.max_x - r.min_x + 1;
+            int height = r.max_y - r.min_y + 1;
+
+            cairo_surface_t *mask = canvas.surface;
+            cairo_t *mask_cr = canvas.cr;
+
+            if (!mask || cairo_image_surface_get_width(mask) < width ||
+                cairo_image_surface_get_height(mask) < height) {
+                free_canvas(&canvas);
+
+                mask = canvas.surface = create_mask_surface(width, job->band_rows);
+
+                mask_cr = canvas.cr = cairo_create(mask);
+                cairo_set_antialias(mask_cr, CAIRO_ANTIALIAS_NONE);
+                cairo_set_operator(mask_cr, CAIRO_OPERATOR_SOURCE);
+                cairo_set_fill_rule(mask_cr, CAIRO_FILL_RULE_EVEN_ODD);
+            }
+
+            clear_mask(mask, width, height);
+
+            cairo_identity_matrix(mask_cr);
+            cairo_translate(mask_cr, -r.min_x, -r.min_y);
+            for (int j = 0; j < g->num_members; j++)
+                render_mask_r(mask_cr, g->members[j]);
+
+            cairo_surface_flush(mask);
+            extract_spans(i, mask, r.min_x, r.min_y, width, height);
+        }
+    }
+
+    pop_cleanup(&canvas, true);
+}
+
+/*
+ * Rasterise coverage of groups [first, first + num) into cur->cover. Each
+ * group is drawn only where its shapes are, and of that only its crop if
+ * full is false, so cost follows the size of groups rather than of the
+ * image.
+ */
+static void render_coverage(int first, int num, bool full)
+{
+    cur->cover = calloc(cur->sgd_height, sizeof(cover_row_t));
+    if (!cur->cover)
+        out_of_memory();
+    count_mem(cur->sgd_height * sizeof(cover_row_t));
+
+    for (int i = first; i < first + num; i++) {
+        set_group_t *g = &cur->groups[i];
+        g->extent = mask_bounds(g);
+        if (!full) {
+            g->extent.min_x = MAX(g->extent.min_x, g->bounds.min_x);
+            g->extent.min_y = MAX(g->extent.min_y, g->bounds.min_y);
+            g->extent.max_x = MIN(g->extent.max_x, g->bounds.max_x);
+            g->extent.max_y = MIN(g->extent.max_y, g->bounds.max_y);
+        }
+    }
+
+    /* a few bands per thread to share out, no higher than a strip */
+    cover_job_t job = { .first = first, .num = num, .band_rows = cur->strip_height };
+    if (cur->opt.jobs > 1)
+        job.band_rows = MIN(job.band_rows, MAX(cur->tile_h, cur->sgd_height / (4 * cur->opt.jobs)));
+
+    run_jobs(render_bands, &job);
+}
+
+/*
+ * When streaming, composed strips are kept deflated for set output passes.
+ */
+typedef struct strip {
+    uint8_t *data;
+    uLongf  size;
+} strip_t;
+
+static void store_strip(int k, const uint8_t *data, int num_rows)
+{
+    uLong len = (uLong)num_rows * cur->sgd_width;
+    strip_t *st = &cur->strips[k];
+
+    st->size = compressBound(len);
+    st->data = malloc(st->size);
+    if (!st->data)
+        out_of_memory();
+    count_mem(st->size);
+    uLongf size = st->size;
+    int res = compress2(st->data, &st->size, data, len, Z_BEST_SPEED);
+    if (res)
+        panic("compress2() failed with %d", res);
+
+    /* give back what compression saved */
+    uint8_t *p = realloc(st->data, st->size);
+    if (p)
+        st->data = p;
+    count_mem(-(size - st->size));
+}
+
+/*
+ * Return strip k, inflated into buf when streaming.
+ */
+static const uint8_t *load_strip(int k, const uint8_t *backgr, uint8_t *buf)
+{
+    if (!cur->strips)
+        return backgr;
+
+    uLongf outlen = (uLongf)cur->strip_height * cur->sgd_width;
+    int res = uncompress(buf, &outlen, cur->strips[k].data, cur->strips[k].size);
+    if (res)
+        panic("uncompress() failed with %d", res);
+    return buf;
+}
+
+/*
+ * Whether groups i and j cover the same pixels of rectangle r alike.
+ */
+static bool same_cover(int i, int j, const bounds_t *r)
+{
+    for (int y = r->min_y; y <= r->max_y; y++) {
+        int n1, n2;
+        const span_t *s1 = group_spans(y, i, r->min_x, r->max_x, &n1);
+        const span_t *s2 = group_spans(y, j, r->min_x, r->max_x, &n2);
+        if (n1 != n2)
+            return false;
+        for (; n1--; s1++, s2++)
+            if (MAX(s1->x0, r->min_x) != MAX(s2->x0, r->min_x) ||
+                MIN(s1->x1, r->max_x + 1) != MIN(s2->x1, r->max_x + 1) || s1->cls != s2->cls)
+                return false;
+    }
+    return true;
+}
+
+static int find_dups(set_group_t *groups, int num_groups)
+{
+    bounds_t all = { 0, 0, cur->sgd_width - 1, cur->sgd_height - 1 };
+    int num_dups = 0;
+
+    for (int i = 0; i < num_groups; i++)
+        groups[i].hash = 0;
+    for (int y = 0; y < cur->sgd_height; y++) {
+        for (int k = 0; k < cur->cover[y].num_spans; k++) {
+            const span_t *s = &cur->cover[y].spans[k];
+            int v[4] = { y, s->x0, s->x1, s->cls };
+            groups[s->group].hash = crc32(groups[s->group].hash, (const Bytef *)v, sizeof(v));
+        }
+    }
+
+    for (int i = 0; i < num_groups; i++) {
+        set_group_t *g = &groups[i];
+        g->full.dup_of = g->crop.dup_of = -1;
+
+        /* the first match is never a duplicate itself */
+        for (int j = 0; j < i; j++) {
+            set_group_t *g2 = &groups[j];
+            if (cur->opt.full_images && g->full.dup_of < 0 && g->hash == g2->hash && same_cover(j, i, &all)) {
+                g->full.dup_of = j;
+                g2->full.keep = true;
+                num_dups++;
+            }
+            if (cur->opt.crop_images && g->crop.dup_of < 0 && !bounds_empty(&g->bounds) &&
+                !memcmp(&g->bounds, &g2->bounds, sizeof(bounds_t)) && same_cover(j, i, &g->bounds)) {
+                g->crop.dup_of = j;
+                g2->crop.keep = true;
+                num_dups++;
+            }
+        }
+    }
+
+    return num_dups;
+}
+
+/*
+ * Output copy of an earlier image, as link if the sink supports it.
+ */
+static void write_dup(const png_copy_t *img, const char *path)
+{
+    if (!cur->sink->link) {
+        uint8_t *data = malloc(img->size);
+        if (!data)
+            out_of_memory();
+        memcpy(data, img->data, img->size);
+        write_output(path, data, img->size);
+        return;
+    }
+
+    pthread_mutex_lock(&cur->sink_lock);
+    int err = cur->sink->link(cur->sink->opaque, path, img->path);
+    pthread_mutex_unlock(&cur->sink_lock);
+
+    if (err)
+        fail(err, "Couldn't link %s: %s", path, strerror(err));
+}
+
+static void free_copy(png_copy_t *img)
+{
+    count_mem(-img->size);
+    free(img->data);
+    free(img->path);
+}
+
+/*
+ * Set images are named kind/<name>_<set>.png next to the base image.
+ */
+static void set_image_name(char *buf, size_t size, const char *kind, const char *name, const char *set)
+{
+    const char *p = strrchr(name, '/');
+    int n = p ? p - name + 1 : 0;
+
+    s_snprintf(buf, size, "%.*s%s/%s_%s.png", n, name, kind, name + n, set);
+}
+
+/*
+ * Compose rows r of a set image from strip starting at image row
+ * strip_y, and pass them on in chunks of about ENCODE_CHUNK_SIZE bytes.
+ */
+static void write_set_rows(image_t *img, const uint8_t *strip, int strip_y, int group, const bounds_t *r)
+{
+    int stride = (r->max_x - r->min_x + 2) / 2;
+    int chunk_rows = MAX(1, ENCODE_CHUNK_SIZE / stride);
+
+    for (int y = r->min_y; y <= r->max_y; y += chunk_rows) {
+        bounds_t c = { r->min_x, y, r->max_x, MIN(r->max_y, y + chunk_rows - 1) };
+        int num_rows = c.max_y - c.min_y + 1;
+        uint8_t *data = image_rows(img, (size_t)stride * num_rows);
+        compose_packed(data, strip, strip_y, group, &c);
+        write_image_rows(img, data, stride, num_rows);
+    }
+}
+
+static void encode_sets(void *arg)
+{
+    set_job_t *job = arg;
+    char buf[1024];
+
+    uint8_t *strip_buf = cur->strips ? pool_alloc((size_t)cur->sgd_width * cur->strip_height) : NULL;
+    push_cleanup(pool_free, strip_buf);
+    if (cur->strips && !strip_buf)
+        out_of_memory();
+    size_t buf_size = cur->strips ? (size_t)cur->sgd_width * cur->strip_height : 0;
+    count_mem(buf_size);
+
+    for (int i; (i = next_job(&job->next)) < job->num_groups; ) {
+        set_group_t *g = &job->groups[i];
+        bool full = cur->opt.full_images && g->full.dup_of < 0;
+        bool crop = cur->opt.crop_images && !bounds_empty(&g->bounds) && g->crop.dup_of < 0;
+        image_t *full_img = NULL, *crop_img = NULL;
+
+        if (full) {
+            set_image_name(buf, sizeof(buf), "full", job->name, g->name);
+            full_img = open_image(buf, cur->sgd_width, cur->sgd_height, 16, true, g->full.keep ? &g->full.copy : NULL);
+        }
+
+        if (crop) {
+            set_image_name(buf, sizeof(buf), "crop", job->name, g->name);
+            crop_img = open_image(buf, g->bounds.max_x - g->bounds.min_x + 1, g->bounds.max_y - g->bounds.min_y + 1,
+                                  16, true, g->crop.keep ? &g->crop.copy : NULL);
+        }
+
+        for (int k = 0, y = 0; y < cur->sgd_height; k++, y += cur->strip_height) {
+            bounds_t r = { 0, y, cur->sgd_width - 1, MIN(y + cur->strip_height, cur->sgd_height) - 1 };
+            bool crop_rows = crop && g->bounds.min_y <= r.max_y && g->bounds.max_y >= r.min_y;
+            if (!full && !crop_rows)
+                continue;
+
+            const uint8_t *strip = load_strip(k, job->backgr, strip_buf);
+
+            if (full)
+                write_set_rows(full_img, strip, y, i, &r);
+
+            if (crop_rows) {
+                r.min_x = g->bounds.min_x;
+                r.max_x = g->bounds.max_x;
+                r.min_y = MAX(r.min_y, g->bounds.min_y);
+                r.max_y = MIN(r.max_y, g->bounds.max_y);
+                write_set_rows(crop_img, strip, y, i, &r);
+            }
+        }
+
+        if (full)
+            close_image(full_img);
+
+        if (crop)
+            close_image(crop_img);
+    }
+
+    pop_cleanup(strip_buf, true);
+    count_mem(-buf_size);
+}
+
+/*
+ * Write 16 bit map of set groups to <name>_sets.png. Each pixel holds one
+ * plus the index of the last group covering it, or zero. Runs of a row
+ * are in group order, so later groups are drawn over earlier ones.
+ */
+static void write_set_map(const char *name)
+{
+    char buf[1024];
+
+    if (cur->num_groups > 65535)
+        fail(EFBIG, "Too many set groups for set map");
+
+    s_snprintf(buf, sizeof(buf), "%s_sets.png", name);
+    image_t *img = open_image(buf, cur->sgd_width, cur->sgd_height, 0, true, NULL);
+
+    size_t stride = 2 * (size_t)cur->sgd_width;
+    int chunk_rows = MAX(1, ENCODE_CHUNK_SIZE / stride);
+
+    for (int y = 0; y < cur->sgd_height; y += chunk_rows) {
+        int num_rows = MIN(chunk_rows, cur->sgd_height - y);
+        uint8_t *data = image_rows(img, stride * num_rows);
+        memset(data, 0, stride * num_rows);
+
+        for (int i = 0; i < num_rows; i++) {
+            const cover_row_t *row = &cur->cover[y + i];
+            for (int k = 0; k < row->num_spans; k++) {
+                const span_t *sp = &row->spans[k];
+                uint8_t *p = &data[i * stride + 2 * sp->x0];
+                for (int x = sp->x0; x < sp->x1; x++, p += 2) {
+                    p[0] = (sp->group + 1) >> 8;
+                    p[1] = sp->group + 1;
+                }
+            }
+        }
+
+        write_image_rows(img, data, stride, num_rows);
+    }
+
+    close_image(img);
+}
+
+/*
+ * Release images and coverage of set groups made by process_sets().
+ */
+static void free_set_images(void)
+{
+    free_cover();
+    for (int i = 0; i < cur->num_groups; i++) {
+        set_group_t *g = &cur->groups[i];
+        free_copy(&g->full.copy);
+        free_copy(&g->crop.copy);
+        g->full = g->crop = (set_image_t){};
+    }
+}
+
+static void process_sets(uint8_t *backgr, const char *name)
+{
+    char buf[1024];
+
+    set_job_t job = {
+        .groups     = cur->groups,
+        .num_groups = cur->num_groups,
+        .backgr     = backgr,
+        .name       = name
+    };
+
+    /* the map always covers whole groups, crops or not */
+    render_coverage(0, job.num_groups, cur->opt.full_images || cur->opt.set_map);
+
+    int num_dups = find_dups(job.groups, job.num_groups);
+
+    info("%d set groups, %d duplicate images", job.num_groups, num_dups);
+
+    if (cur->opt.set_map)
+        write_set_map(name);
+
+    job.next = 0;
+    if (cur->opt.full_images || cur->opt.crop_images)
+        run_jobs(encode_sets, &job);
+    /* copies of duplicate images must be complete */
+    wait_encoders();
+
+    for (int i = 0; i < job.num_groups; i++) {
+        set_group_t *g = &job.groups[i];
+
+        if (cur->opt.full_images && g->full.dup_of >= 0) {
+            set_image_name(buf, sizeof(buf), "full", name, g->name);
+            write_dup(&job.groups[g->full.dup_of].full.copy, buf);
+        }
+
+        if (cur->opt.crop_images && g->crop.dup_of >= 0) {
+            set_image_name(buf, sizeof(buf), "crop", name, g->name);
+            write_dup(&job.groups[g->crop.dup_of].crop.copy, buf);
+        }
+    }
+
+    free_set_images();
+}
+
+/*
+ * Cuts rows of one zoom level into map tiles of tile_size pixels, written
+ * to path/z/x/y.png. Edge tiles are padded with white. White tiles are
+ * skipped, and tiles of one other color are encoded once.
+ */
+typedef struct {
+    const char  *path;
+    int         z;
+    int         width;
+    int         y;
+    uint8_t     *rows;
+    int         num_rows;
+    uint8_t     *tile;
+    png_copy_t  uniform[16];
+} tiler_t;
+
+static void free_tiler(void *arg)
+{
+    tiler_t *t = arg;
+
+    for (int i = 0; i < 16; i++)
+        free_copy(&t->uniform[i]);
+    if (t->rows)
+        count_mem(-(size_t)cur->opt.tile_size * (t->width + cur->opt.tile_size));
+    pool_free(t->rows);
+    pool_free(t->tile);
+    *t = (tiler_t){};
+}
+
+static void open_tiler(tiler_t *t, const char *path, int z, int width)
+{
+    *t = (tiler_t){ .path = path, .z = z, .width = width };
+    push_cleanup(free_tiler, t);
+    t->rows = pool_alloc((size_t)cur->opt.tile_size * width);
+    t->tile = pool_alloc((size_t)cur->opt.tile_size * cur->opt.tile_size);
+    if (!t->rows || !t->tile)
+        out_of_memory();
+    count_mem((size_t)cur->opt.tile_size * (width + cur->opt.tile_size));
+}
+
+static void write_tiles(tiler_t *t)
+{
+    char buf[1024];
+
+    /* pad last tile row */
+    memset(&t->rows[(size_t)t->num_rows * t->width], PAL_WHITE, (size_t)(cur->opt.tile_size - t->num_rows) * t->width);
+
+    for (int x = 0; x * cur->opt.tile_size < t->width; x++) {
+        int w = MIN(cur->opt.tile_size, t->width - x * cur->opt.tile_size);
+        for (int i = 0; i < cur->opt.tile_size; i++) {
+            uint8_t *dst = &t->tile[(size_t)i * cur->opt.tile_size];
+            memcpy(dst, &t->rows[(size_t)i * t->width + x * cur->opt.tile_size], w);
+            memset(dst + w, PAL_WHITE, cur->opt.tile_size - w);
+        }
+
+        size_t size = (size_t)cur->opt.tile_size * cur->opt.tile_size;
+        int color = !memcmp(t->tile, t->tile + 1, size - 1) ? t->tile[0] : -1;
+        cur->map_tiles++;
+
+        if (color == PAL_WHITE) {
+            cur->map_tiles_blank++;
+            continue;
+        }
+
+        s_snprintf(buf, sizeof(buf), "%s/%d/%d/%d.png", t->path, t->z, x, t->y);
+
+        if (color >= 0 && t->uniform[color].data) {
+            write_dup(&t->uniform[color], buf);
+            cur->map_tiles_dup++;
+            continue;
+        }
+
+        png_writer_t png;
+        open_png(&png, buf, cur->opt.tile_size, cur->opt.tile_size, 8, false);
+        write_png_rows(&png, t->tile, cur->opt.tile_size, cur->opt.tile_size);
+        close_png(&png, color >= 0 ? &t->uniform[color] : NULL);
+    }
+
+    t->num_rows = 0;
+    t->y++;
+}
+
+static void tiler_row(tiler_t *t, const uint8_t *row)
+{
+    memcpy(&t->rows[(size_t)t->num_rows * t->width], row, t->width);
+    if (++t->num_rows == cur->opt.tile_size)
+        write_tiles(t);
+}
+
+static void close_tiler(tiler_t *t)
+{
+    if (t->num_rows)
+        write_tiles(t);
+
+    pop_cleanup(t, true);
+}
+
+/*
+ * Reduced scale copy of base image. Pairs of rows of the level above are
+ * collected in rows and halved in both directions.
+ */
+typedef struct {
+    png_writer_t    png;
+    tiler_t         tiler;
+    int             width;
+    int             src_width;
+    uint8_t         *rows;
+    int             num_rows;
+} level_t;
+
+/*
+ * Halve one or two rows of src_width pixels. Each 2x2 block becomes its
+ * most frequent color other than white, so thin lines and labels
+ * survive. Ties go to the lower index, which puts black first.
+ */
+static void reduce_rows(uint8_t *dst, const uint8_t *r0, const uint8_t *r1, int src_width)
+{
+    for (int x = 0; x < src_width; x += 2, dst++) {
+        uint8_t px[4];
+        int n = 0;
+
+        px[n++] = r0[x];
+        if (x + 1 < src_width)
+            px[n++] = r0[x + 1];
+        if (r1) {
+            px[n++] = r1[x];
+            if (x + 1 < src_width)
+                px[n++] = r1[x + 1];
+        }
+
+        if (n == 4 && px[0] == px[1] && px[0] == px[2] && px[0] == px[3]) {
+            *dst = px[0];
+            continue;
+        }
+
+        int best = PAL_WHITE, best_count = 0;
+        for (int i = 0; i < n; i++) {
+            if (px[i] == PAL_WHITE)
+                continue;
+            int count = 0;
+            for (int j = 0; j < n; j++)
+                count += px[j] == px[i];
+            if (count > best_count || (count == best_count && px[i] < best)) {
+                best = px[i];
+                best_count = count;
+            }
+        }
+        *dst = best;
+    }
+}
+
+static void push_level_row(level_t *levels, int k, const uint8_t *row);
+
+static void reduce_level(level_t *levels, int k)
+{
+    level_t *l = &levels[k];
+    const uint8_t *r1 = l->num_rows == 2 ? l->rows + l->src_width : NULL;
+    uint8_t *out = l->rows + 2 * l->src_width;
+
+    reduce_rows(out, l->rows, r1, l->src_width);
+    l->num_rows = 0;
+    if (cur->opt.tile_size)
+        tiler_row(&l->tiler, out);
+    else
+        write_png_rows(&l->png, out, l->width, 1);
+
+    if (k + 1 < cur->opt.levels)
+        push_level_row(levels, k + 1, out);
+}
+
+static void push_level_row(level_t *levels, int k, const uint8_t *row)
+{
+    level_t *l = &levels[k];
+
+    memcpy(l->rows + l->num_rows * l->src_width, row, l->src_width);
+    if (++l->num_rows == 2)
+        reduce_level(levels, k);
+}
+
+/*
+ * Images of levels are released by their own cleanups, which run first.
+ */
+static void free_levels(void *arg)
+{
+    level_t *levels = arg;
+
+    for (int k = 0; k < cur->opt.levels; k++) {
+        if (levels[k].rows)
+            count_mem(-(2 * levels[k].src_width + levels[k].width));
+        free(levels[k].rows);
+    }
+
+    free(levels);
+}
+
+static level_t *open_levels(const char *path)
+{
+    level_t *levels = calloc(cur->opt.levels, sizeof(level_t));
+    if (!levels)
+        out_of_memory();
+    push_cleanup(free_levels, levels);
+
+    int width = cur->sgd_width, height = cur->sgd_height;
+    char buf[1024];
+
+    for (int k = 0; k < cur->opt.levels; k++) {
+        level_t *l = &levels[k];
+        l->src_width = width;
+        width = (width + 1) / 2;
+        height = (height + 1) / 2;
+        l->width = width;
+
+        /* two source rows and one reduced row */
+        l->rows = malloc(2 * l->src_width + l->width);
+        if (!l->rows)
+            out_of_memory();
+        count_mem(2 * l->src_width + l->width);
+
+        if (cur->opt.tile_size) {
+            open_tiler(&l->tiler, path, cur->opt.levels - k - 1, width);
+        } else {
+            s_snprintf(buf, sizeof(buf), "%s_%d.png", path, 2 << k);
+            open_png(&l->png, buf, width, height, 8, false);
+        }
+    }
+
+    return levels;
+}
+
+/*
+ * Reduce rows left over from odd heights, top level first, and write
+ * all levels.
+ */
+static void close_levels(level_t *levels)
+{
+    for (int k = 0; k < cur->opt.levels; k++) {
+        if (levels[k].num_rows)
+            reduce_level(levels, k);
+        if (cur->opt.tile_size)
+            close_tiler(&levels[k].tiler);
+        else
+            close_png(&levels[k].png, NULL);
+    }
+
+    pop_cleanup(levels, true);
+}
+
+/*
+ * Deflated images and strips are assumed to take this fraction of their
+ * raw size, as for sheets of mostly blank paper.
+ */
+#define DEFLATE_RATIO   4
+
+static size_t estimate_png(size_t width, size_t height)
+{
+    return MAX(0x10000, (width / 2 + 2) * height / DEFLATE_RATIO);
+}
+
+/*
+ * Upper estimate of bytes convert() holds at once with current options,
+ * as counted by count_mem(). Work on the base image and on set images
+ * share the file data, tile state and strip buffer, and do not overlap
+ * otherwise, except for images in the hands of encoder threads.
+ */
+static size_t estimate_memory(void)
+{
+    const sgd_options *opt = &cur->opt;
+    size_t width = cur->sgd_width, height = cur->sgd_height;
+    size_t rows = opt->stream ? MIN(cur->tile_h, height) : height;
+    size_t stride = cairo_format_stride_for_width(CAIRO_FORMAT_A8, width);
+    size_t num_tiles = (size_t)cur->h_tiles * cur->v_tiles;
+    bool sets = (opt->full_images || opt->crop_images || opt->set_map) && cur->num_groups;
+    bool use_strips = opt->stream && (opt->full_images || opt->crop_images) && cur->num_groups && rows < height;
+
+    size_t common = cur->base_alloc + num_tiles * TILE_INFO_SIZE + width * rows +
+                    (size_t)cur->h_tiles * ((rows + cur->tile_h - 1) / cur->tile_h) * tile_pixels();
+    if (opt->stream)
+        common += num_tiles * sizeof(uint8_t *) + (size_t)cur->h_tiles * tile_pixels();
+    if (cur->tile_depth != 8)
+        common += tile_stride() * cur->tile_h;
+    if (use_strips)
+        common += width * height / DEFLATE_RATIO;
+
+    size_t base_mem = stride * rows;
+    if (opt->base_image && opt->tile_size)
+        base_mem += (size_t)opt->tile_size * (width + opt->tile_size) + estimate_png(opt->tile_size, opt->tile_size);
+    else if (opt->base_image)
+        base_mem += estimate_png(width, height);
+    if (opt->base_image) {
+        for (int k = 0; k < opt->levels; k++) {
+            size_t w = (width + 1) >> (k + 1), h = (height + 1) >> (k + 1);
+            base_mem += 2 * (width >> k) + w + 2 +
+                        (opt->tile_size ? (size_t)opt->tile_size * (w + opt->tile_size) +
+                                          estimate_png(opt->tile_size, opt->tile_size)
+                                        : estimate_png(w, h));
+        }
+    }
+    base_mem = MAX(base_mem, 2 * num_tiles * sizeof(int));
+
+    size_t set_mem = 0;
+    if (sets) {
+        set_mem += height * (sizeof(cover_row_t) + 8 * sizeof(span_t));
+        for (int i = 0; i < cur->num_groups; i++) {
+            const bounds_t *b = &cur->groups[i].bounds;
+            size_t h = bounds_empty(b) ? height : b->max_y - b->min_y + 1;
+            set_mem += 2 * h * sizeof(span_t);
+        }
+
+        /* rows of a full and a crop image, composed in chunks */
+        size_t chunk = MIN((width + 1) / 2 * rows, MAX(ENCODE_CHUNK_SIZE, (width + 1) / 2));
+        size_t job_mem = 2 * chunk + (use_strips ? width : 0) * rows + stride * rows;
+        if (opt->full_images)
+            job_mem += estimate_png(width, height);
+        if (opt->crop_images)
+            job_mem += estimate_png(width, height);
+        set_mem += MIN(opt->jobs, cur->num_groups) * job_mem;
+        if (opt->set_map)
+            set_mem += MAX(ENCODE_CHUNK_SIZE, 2 * width) + estimate_png(width, height);
+    }
+
+    size_t encoder_mem = 0;
+    if (opt->encoders && ((opt->base_image && !opt->tile_size) || sets))
+        encoder_mem = opt->encoders * (ENCODE_QUEUE_SIZE + estimate_png(width, height));
+
+    return common + MAX(base_mem, set_mem) + encoder_mem;
+}
+
+/*
+ * Release everything made for one conversion or rendering.
+ */
+static void free_convert(void)
+{
+    if (cur->strips) {
+        for (int k = 0; k < (cur->sgd_height + cur->strip_height - 1) / cur->strip_height; k++)
+            free(cur->strips[k].data);
+        free(cur->strips);
+        cur->strips = NULL;
+    }
+
+    free_set_images();
+
+    pool_free(cur->backgr);
+    pool_free(cur->tiles);
+    free(cur->tile_ref);
+    free(cur->tile_last);
+    /* tiles are left cached only if decoding stopped early */
+    if (cur->tile_cache)
+        for (int i = 0; i < cur->h_tiles * cur->v_tiles; i++)
+            free(cur->tile_cache[i]);
+    free(cur->tile_cache);
+    pool_free(cur->tile_raw);
+    free(cur->tile_fill);
+    free(cur->tile_color);
+    cur->backgr = NULL;
+    cur->tiles = NULL;
+    cur->tile_ref = NULL;
+    cur->tile_last = NULL;
+    cur->tile_cache = NULL;
+    cur->tile_raw = NULL;
+    cur->tile_fill = NULL;
+    cur->tile_color = NULL;
+    cur->tiles_decoded = 0;
+    cur->tiles_copied = 0;
+    cur->map_tiles = cur->map_tiles_blank = cur->map_tiles_dup = 0;
+
+    /* only file data is left */
+    cur->mem_used = cur->base_alloc;
+}
+
+/*
+ * Tile rows [first_row, end_row) that convert() decodes. Without base
+ * image, only tile rows of selected crops are needed.
+ */
+static void needed_rows(int *first_row, int *end_row)
+{
+    set_group_t *groups = cur->groups;
+    int num_groups = cur->opt.full_images || cur->opt.crop_images ? cur->num_groups : 0;
+
+    *first_row = 0;
+    *end_row = cur->v_tiles;
+    if (cur->opt.base_image || (cur->opt.full_images && num_groups))
+        return;
+
+    *first_row = cur->v_tiles;
+    *end_row = 0;
+    for (int i = 0; i < num_groups; i++) {
+        if (bounds_empty(&groups[i].bounds))
+            continue;
+        *first_row = MIN(*first_row, groups[i].bounds.min_y / cur->tile_h);
+        *end_row = MAX(*end_row, groups[i].bounds.max_y / cur->tile_h + 1);
+    }
+    *end_row = MAX(*first_row, *end_row);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void convert(void *arg)
+{
+    const char *path = arg;
+    int num_strips;
+    double start = now();
+
+    cur->mem_peak = cur->mem_used;
+    cur->strip_height = cur->opt.stream ? cur->tile_h : cur->sgd_height;
+    num_strips = (cur->sgd_height + cur->strip_height - 1) / cur->strip_height;
+
+    int first_row, end_row;
+    needed_rows(&first_row, &end_row);
+
+    hash_tiles(first_row, end_row);
+
+    size_t tiles_size = (size_t)cur->h_tiles * ((cur->strip_height + cur->tile_h - 1) / cur->tile_h) * tile_pixels();
+    uint8_t *backgr = cur->backgr = pool_alloc((size_t)cur->sgd_width * cur->strip_height);
+    cur->tiles = pool_alloc(tiles_size);
+    if (!backgr || !cur->tiles)
+        out_of_memory();
+    count_mem((size_t)cur->sgd_width * cur->strip_height + tiles_size);
+
+    if (cur->opt.stream && num_strips > 1 && (cur->opt.full_images || cur->opt.crop_images)) {
+        cur->strips = calloc(num_strips, sizeof(strip_t));
+        if (!cur->strips)
+            out_of_memory();
+        count_mem(num_strips * sizeof(strip_t));
+    }
+
+    if (cur->opt.encoders && ((cur->opt.base_image && !cur->opt.tile_size) ||
+                              cur->opt.full_images || cur->opt.crop_images || cur->opt.set_map))
+        start_encoders();
+
+    char buf[1024];
+    image_t *png = NULL;
+    tiler_t tiler;
+    level_t *levels = NULL;
+
+    if (cur->opt.base_image) {
+        if (cur->opt.tile_size) {
+            open_tiler(&tiler, path, cur->opt.levels, cur->sgd_width);
+        } else {
+            s_snprintf(buf, sizeof(buf), "%s.png", path);
+            png = open_image(buf, cur->sgd_width, cur->sgd_height, 8, false, NULL);
+        }
+
+        if (cur->opt.levels)
+            levels = open_levels(path);
+    }
+
+    for (int k = 0, y = 0; y < cur->sgd_height; k++, y += cur->strip_height) {
+        int y0 = MAX(y, first_row * cur->tile_h);
+        int y1 = MIN(MIN(y + cur->strip_height, cur->sgd_height), end_row * cur->tile_h);
+        if (y0 >= y1)
+            continue;
+
+        int num_rows = y1 - y0;
+        uint8_t *rows = &backgr[(size_t)(y0 - y) * cur->sgd_width];
+
+        decode_tiles(y0 / cur->tile_h, (num_rows + cur->tile_h - 1) / cur->tile_h);
+
+        cairo_surface_t *mask = render_labels(y0, num_rows);
+        render_tiles(rows, mask, y0 / cur->tile_h, num_rows);
+        pop_cleanup(mask, true);
+
+        if (cur->opt.base_image && cur->opt.tile_size)
+            for (int i = 0; i < num_rows; i++)
+                tiler_row(&tiler, &rows[(size_t)i * cur->sgd_width]);
+        else if (cur->opt.base_image && cur->strip_height < cur->sgd_height)
+            copy_image_rows(png, rows, cur->sgd_width, num_rows);
+        else if (cur->opt.base_image)
+            write_image_rows(png, rows, cur->sgd_width, num_rows);
+
+        if (levels)
+            for (int i = 0; i < num_rows; i++)
+                push_level_row(levels, 0, &rows[(size_t)i * cur->sgd_width]);
+
+        if (cur->strips)
+            store_strip(k, backgr, num_rows);
+    }
+
+    if (cur->opt.base_image && cur->opt.tile_size)
+        close_tiler(&tiler);
+    else if (cur->opt.base_image)
+        close_image(png);
+
+    if (levels)
+        close_levels(levels);
+
+    int tiles_uniform = 0;
+    for (int i = first_row * cur->h_tiles; i < end_row * cur->h_tiles; i++)
+        tiles_uniform += cur->tile_fill[i] >= 0;
+
+    info("%d tiles, %d decoded, %d duplicates, %d uniform",
+         (end_row - first_row) * cur->h_tiles, cur->tiles_decoded, cur->tiles_copied, tiles_uniform);
+
+    if (cur->opt.tile_size)
+        info("%d map tiles, %d blank, %d duplicates", cur->map_tiles, cur->map_tiles_blank, cur->map_tiles_dup);
+
+    /* without set images, the base image is done once encoded */
+    if (!cur->opt.full_images && !cur->opt.crop_images && !cur->opt.set_map)
+        wait_encoders();
+
+    double sets_start = now();
+    cur->base_time = sets_start - start;
+
+    if (cur->opt.full_images || cur->opt.crop_images || cur->opt.set_map)
+        process_sets(backgr, path);
+
+    if (cur->encoder) {
+        wait_encoders();
+        pop_cleanup(cur->encoder, true);
+    }
+
+    cur->set_time = now() - sets_start;
+
+    info("%.1f MiB memory estimated, %.1f MiB used",
+         estimate_memory() / 1048576.0, cur->mem_peak / 1048576.0);
+
+    free_convert();
+}
+
+/*
+ * Render whole image in one strip to dst.
+ */
+static void render_background(uint8_t *dst)
+{
+    cur->strip_height = cur->sgd_height;
+
+    hash_tiles(0, cur->v_tiles);
+
+    cur->tiles = pool_alloc((size_t)cur->h_tiles * cur->v_tiles * tile_pixels());
+    if (!cur->tiles)
+        out_of_memory();
+    count_mem((size_t)cur->h_tiles * cur->v_tiles * tile_pixels());
+
+    decode_tiles(0, cur->v_tiles);
+
+    cairo_surface_t *mask = render_labels(0, cur->sgd_height);
+    render_tiles(dst, mask, 0, cur->sgd_height);
+    pop_cleanup(mask, true);
+}
+
+static void render_base(void *arg)
+{
+    render_background(arg);
+    free_convert();
+}
+
+typedef struct {
+    int         index;
+    bool        crop;
+    uint8_t     *buf;
+} render_set_t;
+
+static void render_set(void *arg)
+{
+    render_set_t *rs = arg;
+    set_group_t *g = &cur->groups[rs->index];
+    bounds_t r = { 0, 0, cur->sgd_width - 1, cur->sgd_height - 1 };
+
+    if (rs->crop) {
+        if (bounds_empty(&g->bounds))
+            panic("Selection set has no crop");
+        r = g->bounds;
+    }
+
+    cur->backgr = pool_alloc((size_t)cur->sgd_width * cur->sgd_height);
+    if (!cur->backgr)
+        out_of_memory();
+    count_mem((size_t)cur->sgd_width * cur->sgd_height);
+
+    render_background(cur->backgr);
+
+    render_coverage(rs->index, 1, !rs->crop);
+    compose_rows(rs->buf, cur->backgr, 0, rs->index, &r);
+
+    free_convert();
+}
+
+static void alloc_base(size_t size)
+{
+    uint8_t *p = realloc(cur->base, size + BASE_SLACK);
+    if (!p)
+        out_of_memory();
+    cur->base = p;
+    count_mem(size + BASE_SLACK - cur->base_alloc);
+    cur->base_alloc = size + BASE_SLACK;
+}
+
+static void end_inflate(void *z)
+{
+    inflateEnd(z);
+}
+
+static void uncompress_zgd(const uint8_t *data, size_t len)
+{
+    size_t max_size = cur->opt.max_size;
+
+    /* gzip trailer holds uncompressed size modulo 2^32 */
+    uint32_t isize = 0;
+    if (len >= sizeof(isize))
+        memcpy(&isize, data + len - sizeof(isize), sizeof(isize));
+
+    size_t size = MIN(MAX(isize, 0x10000), max_size);
+    alloc_base(size);
+
+    z_stream z = {
+        .next_in  = (uint8_t *)data,
+        .avail_in = len
+    };
+
+    if (inflateInit2(&z, 32 + 15))
+        out_of_memory();
+    push_cleanup(end_inflate, &z);
+
+    int res = Z_OK;
+    while (res != Z_STREAM_END) {
+        if (!z.avail_in)
+            panic("Partial file");
+        if (z.total_out == size) {
+            if (size == max_size)
+                fail(EFBIG, "SGD file too big");
+            size = MIN(size * 2, max_size);
+            alloc_base(size);
+        }
+        z.next_out  = cur->base + z.total_out;
+        z.avail_out = size - z.total_out;
+        res = inflate(&z, Z_NO_FLUSH);
+        if (res != Z_OK && res != Z_STREAM_END)
+            panic("inflate() failed with %d", res);
+    }
+
+    cur->file_size = z.total_out;
+    pop_cleanup(&z, true);
+
+    /* return the unused part of the last doubling */
+    alloc_base(cur->file_size);
+}
+
+static bool is_gzip(const uint8_t *data, size_t len)
+{
+    uint32_t hdr = 0;
+    memcpy(&hdr, data, MIN(len, sizeof(hdr)));
+    return (hdr & 0xe0ffffff) == 0x00088b1f;
+}
+
+static void set_palette(void)
+{
+    const sgd_color *pal = cur->opt.palette;
+
+    for (int i = 0; i < 16; i++) {
+        if (pal) {
+            cur->png_pal[i] = (png_color){ pal[i].r, pal[i].g, pal[i].b };
+        } else {
+            cur->png_pal[i] = sgd_pal[i % 8];
+            if (i >= 8)
+                cur->png_pal[i].blue = 0;
+        }
+    }
+}
+
+static void check_options(void)
+{
+    if (cur->opt.max_size < 1 << 20 || cur->opt.max_size > (size_t)2047 << 20)
+        panic("Bad size limit");
+
+    if (cur->opt.compression < Z_DEFAULT_COMPRESSION || cur->opt.compression > Z_BEST_COMPRESSION)
+        panic("Bad PNG compression level");
+
+    if (cur->opt.jobs < 1 || cur->opt.jobs > 256)
+        panic("Bad number of threads");
+
+    if (cur->opt.encoders < 0 || cur->opt.encoders > 256)
+        panic("Bad number of encoder threads");
+
+    if (cur->opt.levels < 0 || cur->opt.levels > 8)
+        panic("Bad number of reduced levels");
+
+    if (cur->opt.tile_size && (cur->opt.tile_size < 16 || cur->opt.tile_size > 4096))
+        panic("Bad map tile size");
+}
+
+typedef struct {
+    const uint8_t   *data;
+    size_t          len;
+    uint8_t         *owned;
+} load_t;
+
+/*
+ * Owned data is used in place, unless it needs uncompressing. Then it is
+ * left in owned for the caller to free.
+ */
+static void load_sgd(void *arg)
+{
+    load_t *l = arg;
+    bool gzip = is_gzip(l->data, l->len);
+
+    if (l->owned && !gzip) {
+        cur->base = l->owned;
+        l->owned = NULL;
+        cur->base_alloc = l->len + BASE_SLACK;
+        count_mem(cur->base_alloc);
+    }
+
+    check_options();
+
+    if (gzip) {
+        uncompress_zgd(l->data, l->len);
+    } else {
+        if (l->len > cur->opt.max_size)
+            fail(EFBIG, "SGD file too big");
+        if (cur->base != l->data) {
+            alloc_base(l->len);
+            memcpy(cur->base, l->data, l->len);
+        }
+        cur->file_size = l->len;
+    }
+
+    memset(cur->base + cur->file_size, 0, BASE_SLACK);
+
+    if (cur->file_size < SGD_OFFSET)
+        panic("SGD file too small");
+
+    set_palette();
+    parse_header();
+    collect_groups();
+}
+
+/* bytes read or inflated at once when scanning */
+#define SCAN_CHUNK  (64 << 10)
+
+typedef struct {
+    FILE        *fp;
+    uint64_t    offset;
+    uint64_t    size;
+    bool        gzip;
+    z_stream    z;
+    uint8_t     *in;
+    uint64_t    in_pos;
+} scan_t;
+
+static void scan_raw(scan_t *s, uint64_t pos, void *buf, size_t len)
+{
+    if (fseeko(s->fp, s->offset + pos, SEEK_SET) || fread(buf, 1, len, s->fp) != len) {
+        if (ferror(s->fp))
+            fail(EIO, "Couldn't read file");
+        panic("Partial file");
+    }
+}
+
+/*
+ * Make file data from start to end available, reading it, or inflating
+ * everything up to it.
+ */
+static void scan_read(scan_t *s, uint64_t start, uint64_t end)
+{
+    end = MIN(end, cur->file_size);
+    if (start >= end)
+        return;
+
+    if (!s->gzip) {
+        scan_raw(s, start, cur->base + start, end - start);
+        return;
+    }
+
+    while (s->z.total_out < end) {
+        if (!s->z.avail_in) {
+            size_t len = MIN(SCAN_CHUNK, s->size - s->in_pos);
+            if (!len)
+                panic("Partial file");
+            scan_raw(s, s->in_pos, s->in, len);
+            s->in_pos += len;
+            s->z.next_in  = s->in;
+            s->z.avail_in = len;
+        }
+        s->z.next_out  = cur->base + s->z.total_out;
+        s->z.avail_out = MIN(cur->file_size - s->z.total_out, SCAN_CHUNK);
+        int res = inflate(&s->z, Z_NO_FLUSH);
+        if (res == Z_STREAM_END) {
+            cur->file_size = s->z.total_out;
+            break;
+        }
+        if (res != Z_OK)
+            panic("inflate() failed with %d", res);
+    }
+}
+
+/*
+ * End of data of entry at file offset pos, as far as data read up to
+ * loaded tells.
+ */
+static uint64_t entry_end(uint64_t pos, uint64_t loaded)
+{
+    SGDEntry *e = (SGDEntry *)(cur->base + pos);
+
+    switch (e->hdr.type) {
+    case SGD_POLYLINE2D:
+        return pos + sizeof(SGDPolyline) + (uint64_t)e->polyline.num_points * sizeof(SGDPoint);
+    case SGD_LASSO2D:
+        return pos + sizeof(SGDLasso) + (uint64_t)e->lasso.num_points * sizeof(SGDPoint);
+    case SGD_SIMPLEAREA:
+    case SGD_CONNECTEDAREA:
+        return pos + sizeof(SGDSimpleArea) + (uint64_t)e->simple_area.num_entries * sizeof(uint32_t);
+    case SGD_SET:
+        return pos + sizeof(SGDSet) + (uint64_t)e->set.num_entries * sizeof(uint32_t);
+    case SGD_TEXTLINE2D:;
+        uint64_t text = pos + offsetof(SGDTextline, text);
+        char *end = text < loaded ? memchr(e->textline.text, 0, loaded - text) : NULL;
+        return end ? (uint64_t)((uint8_t *)end - cur->base) + 1 : loaded + SCAN_CHUNK;
+    default:
+        return pos + sizeof(SGDEntry);
+    }
+}
+
+/*
+ * Read the span of file data holding directory entries. How far their
+ * counts and texts reach is known once they are read, so the span grows
+ * until it covers them.
+ */
+static void scan_entries(scan_t *s)
+{
+    SGDDirectoryType0 *dir = cur->dir;
+    uint64_t start = UINT64_MAX, end = 0;
+
+    for (int i = 0; i < dir->num_entries; i++) {
+        if (dir->addr[i] > file_size_off())
+            panic("Bad entry address");
+        start = MIN(start, SGD_OFFSET + (uint64_t)dir->addr[i]);
+        end = MAX(end, SGD_OFFSET + (uint64_t)dir->addr[i] + sizeof(SGDEntry));
+    }
+
+    for (uint64_t loaded = start; loaded < MIN(end, cur->file_size); ) {
+        scan_read(s, loaded, end);
+        loaded = MIN(end, cur->file_size);
+        for (int i = 0; i < dir->num_entries; i++)
+            end = MAX(end, entry_end(SGD_OFFSET + (uint64_t)dir->addr[i], loaded));
+    }
+}
+
+/*
+ * Read only the header, directory and entries of file data, which is
+ * enough for sets, their bounds and stats.
+ */
+static void scan_sgd(void *arg)
+{
+    scan_t *s = arg;
+    uint8_t magic[4] = {};
+
+    cur->scanned = true;
+    check_options();
+
+    scan_raw(s, 0, magic, MIN(s->size, sizeof(magic)));
+    s->gzip = is_gzip(magic, MIN(s->size, sizeof(magic)));
+
+    uint64_t size = s->size;
+    if (s->gzip) {
+        /* gzip trailer holds uncompressed size modulo 2^32 */
+        uint32_t isize = 0;
+        if (s->size >= sizeof(isize))
+            scan_raw(s, s->size - sizeof(isize), &isize, sizeof(isize));
+        size = MIN(isize, cur->opt.max_size);
+
+        if (!(s->in = malloc(SCAN_CHUNK)))
+            out_of_memory();
+        push_cleanup(free, s->in);
+        if (inflateInit2(&s->z, 32 + 15))
+            out_of_memory();
+        push_cleanup(end_inflate, &s->z);
+    }
+    if (size > cur->opt.max_size)
+        fail(EFBIG, "SGD file too big");
+
+    /* data not read stays zero */
+    if (!(cur->base = calloc(1, size + BASE_SLACK)))
+        out_of_memory();
+    cur->base_alloc = size + BASE_SLACK;
+    count_mem(cur->base_alloc);
+    cur->file_size = size;
+
+    scan_read(s, 0, SGD_OFFSET + 8 + sizeof(SGDMrciHeader));
+    if (cur->file_size < SGD_OFFSET)
+        panic("SGD file too small");
+
+    SGDDirectoryTable *t = (SGDDirectoryTable *)(cur->base + 0x4c);
+    for (int i = 0; i < t->num_entries && i < 8; i++) {
+        uint64_t addr = t->entry[i].addr;
+        if (t->entry[i].type || addr > cur->file_size)
+            continue;
+        scan_read(s, addr, addr + sizeof(SGDDirectoryType0));
+        SGDDirectoryType0 *d = (SGDDirectoryType0 *)(cur->base + addr);
+        scan_read(s, addr + sizeof(*d), addr + sizeof(*d) + (uint64_t)d->num_entries * sizeof(uint32_t));
+        break;
+    }
+
+    cur->dir = find_directory();
+    scan_entries(s);
+
+    if (s->gzip) {
+        pop_cleanup(&s->z, true);
+        pop_cleanup(s->in, true);
+    }
+
+    set_palette();
+    parse_header();
+    collect_groups();
+}
+
+static void close_file(void *arg)
+{
+    (void)arg;
+
+    free_convert();
+
+    for (int i = 0; i < cur->num_groups; i++)
+        free(cur->groups[i].members);
+    free(cur->groups);
+
+    free_set_order();
+    free(cur->base);
+}
+
+void sgd_default_options(sgd_options *opt)
+{
+    *opt = (sgd_options){
+        .max_size    = 256 << 20,
+        .compression = Z_DEFAULT_COMPRESSION,
+        .jobs        = 1,
+        .base_image  = 1,
+    };
+}
+
+static int open_file(sgd_file **fp, const uint8_t *data, size_t len, uint8_t *owned, const sgd_options *opt)
+{
+    *fp = NULL;
+
+    sgd_file *f = calloc(1, sizeof(*f));
+    if (!f) {
+        free(owned);
+        snprintf(last_error, sizeof(last_error), "Out of memory");
+        return -ENOMEM;
+    }
+
+    f->opt = *opt;
+    pthread_mutex_init(&f->sink_lock, NULL);
+    pthread_mutex_init(&f->job_lock, NULL);
+
+    load_t l = { data, len, owned };
+    int err = run_protected(f, load_sgd, &l);
+    free(l.owned);
+    if (err) {
+        sgd_close(f);
+        return err;
+    }
+
+    *fp = f;
+    return 0;
+}
+
+int sgd_open_memory(sgd_file **f, const void *data, size_t size, const sgd_options *opt)
+{
+    return open_file(f, data, size, NULL, opt);
+}
+
+int sgd_open_owned(sgd_file **f, void *data, size_t size, const sgd_options *opt)
+{
+    return open_file(f, data, size, data, opt);
+}
+
+int sgd_open_path(sgd_file **f, const char *path, const sgd_options *opt)
+{
+    *f = NULL;
+
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+        goto fail;
+
+    if (fseek(fp, 0, SEEK_END))
+        goto fail_close;
+    long size = ftell(fp);
+    if (size < 0 || fseek(fp, 0, SEEK_SET))
+        goto fail_close;
+
+    if (size > opt->max_size) {
+        fclose(fp);
+        snprintf(last_error, sizeof(last_error), "SGD file too big");
+        return -EFBIG;
+    }
+
+    uint8_t *data = malloc(size + SGD_SLACK);
+    if (!data) {
+        fclose(fp);
+        snprintf(last_error, sizeof(last_error), "Out of memory");
+        return -ENOMEM;
+    }
+
+    if (fread(data, 1, size, fp) != (size_t)size) {
+        free(data);
+        goto fail_close;
+    }
+
+    fclose(fp);
+    return open_file(f, data, size, data, opt);
+
+fail_close:
+    if (!errno)
+        errno = EIO;
+    int err = errno;
+    fclose(fp);
+    errno = err;
+fail:
+    snprintf(last_error, sizeof(last_error), "Couldn't read %s: %s", path, strerror(errno));
+    return -errno;
+}
+
+int sgd_scan_path(sgd_file **fp, const char *path, uint64_t offset, uint64_t size, const sgd_options *opt)
+{
+    *fp = NULL;
+
+    sgd_file *f = calloc(1, sizeof(*f));
+    if (!f) {
+        snprintf(last_error, sizeof(last_error), "Out of memory");
+        return -ENOMEM;
+    }
+
+    f->opt = *opt;
+    pthread_mutex_init(&f->sink_lock, NULL);
+    pthread_mutex_init(&f->job_lock, NULL);
+
+    scan_t s = { .offset = offset, .size = size };
+    int err;
+    if (!(s.fp = fopen(path, "rb"))) {
+        err = -errno;
+        snprintf(last_error, sizeof(last_error), "Couldn't read %s: %s", path, strerror(errno));
+    } else {
+        err = run_protected(f, scan_sgd, &s);
+        fclose(s.fp);
+    }
+    if (err) {
+        sgd_close(f);
+        return err;
+    }
+
+    *fp = f;
+    return 0;
+}
+
+void sgd_close(sgd_file *f)
+{
+    if (!f)
+        return;
+
+    run_protected(f, close_file, NULL);
+    pthread_mutex_destroy(&f->sink_lock);
+    pthread_mutex_destroy(&f->job_lock);
+    free(f);
+}
+
+const char *sgd_last_error(void)
+{
+    return last_error;
+}
+
+static void get_size(void *arg)
+{
+    int *size = arg;
+
+    size[0] = cur->sgd_width;
+    size[1] = cur->sgd_height;
+}
+
+void sgd_get_size(const sgd_file *f, int *width, int *height)
+{
+    int size[2];
+
+    run_protected((sgd_file *)f, get_size, size);
+    *width = size[0];
+    *height = size[1];
+}
+
+static void get_estimate(void *arg)
+{
+    *(size_t *)arg = estimate_memory();
+}
+
+size_t sgd_estimate_memory(const sgd_file *f)
+{
+    size_t size = 0;
+
+    run_protected((sgd_file *)f, get_estimate, &size);
+    return size;
+}
+
+size_t sgd_peak_memory(const sgd_file *f)
+{
+    return f->mem_peak;
+}
+
+void sgd_get_pool_stats(sgd_pool_stats *stats)
+{
+    pthread_mutex_lock(&pool.lock);
+    *stats = (sgd_pool_stats){
+        .requests   = pool.requests,
+        .hits       = pool.hits,
+        .held       = pool.held,
+    };
+    pthread_mutex_unlock(&pool.lock);
+}
+
+void sgd_free_pool(void)
+{
+    pthread_mutex_lock(&pool.lock);
+    while (pool.num_free)
+        free(pool.free[--pool.num_free]);
+    pool.held = 0;
+    pthread_mutex_unlock(&pool.lock);
+}
+
+void sgd_set_pool_limit(size_t size)
+{
+    pthread_mutex_lock(&pool.lock);
+    pool.limit = size;
+    pool_trim();
+    pthread_mutex_unlock(&pool.lock);
+}
+
+static void get_stats(void *arg)
+{
+    sgd_stats *stats = arg;
+    int first_row, end_row;
+
+    needed_rows(&first_row, &end_row);
+
+    *stats = (sgd_stats){
+        .width       = cur->sgd_width,
+        .height      = cur->sgd_height,
+        .num_tiles   = cur->h_tiles * cur->v_tiles,
+        .num_entries = cur->dir->num_entries,
+        .num_sets    = cur->num_groups,
+        .base_pixels = (double)cur->sgd_width * MIN(cur->sgd_height, (end_row - first_row) * cur->tile_h),
+        .base_time   = cur->base_time,
+        .set_time    = cur->set_time
+    };
+
+    for (int i = 0; i < cur->num_groups; i++) {
+        const bounds_t *b = &cur->groups[i].bounds;
+        if (cur->opt.full_images)
+            stats->set_pixels += (double)cur->sgd_width * cur->sgd_height;
+        if (cur->opt.crop_images && !bounds_empty(b))
+            stats->set_pixels += (double)(b->max_x - b->min_x + 1) * (b->max_y - b->min_y + 1);
+    }
+    if (cur->opt.set_map && cur->num_groups)
+        stats->set_pixels += (double)cur->sgd_width * cur->sgd_height;
+}
+
+void sgd_get_stats(const sgd_file *f, sgd_stats *stats)
+{
+    run_protected((sgd_file *)f, get_stats, stats);
+}
+
+int sgd_num_sets(const sgd_file *f)
+{
+    return f->num_groups;
+}
+
+int sgd_get_set(const sgd_file *f, int index, sgd_set_info *info)
+{
+    if (index < 0 || index >= f->num_groups) {
+        snprintf(last_error, sizeof(last_error), "Bad selection set index");
+        return -EINVAL;
+    }
+
+    const set_group_t *g = &f->groups[index];
+
+    *info = (sgd_set_info){ .num_members = g->num_members };
+    strcpy(info->name, g->name);
+
+    for (int k = 0; k < g->num_members; k++)
+        info->num_entries += g->members[k]->set.num_entries;
+
+    if (!bounds_empty(&g->bounds)) {
+        info->x0 = g->bounds.min_x;
+        info->y0 = g->bounds.min_y;
+        info->x1 = g->bounds.max_x + 1;
+        info->y1 = g->bounds.max_y + 1;
+    }
+
+    if (!bounds_empty(&g->set_bounds)) {
+        info->set_x0 = g->set_bounds.min_x;
+        info->set_y0 = g->set_bounds.min_y;
+        info->set_x1 = g->set_bounds.max_x + 1;
+        info->set_y1 = g->set_bounds.max_y + 1;
+    }
+
+    return 0;
+}
+
+static void abort_convert(void *arg)
+{
+    (void)arg;
+    free_convert();
+}
+
+int sgd_render_base(sgd_file *f, uint8_t *buf)
+{
+    if (f->scanned) {
+        snprintf(last_error, sizeof(last_error), "File opened for scanning only");
+        return -EINVAL;
+    }
+
+    int err = run_protected(f, render_base, buf);
+    if (err)
+        run_protected(f, abort_convert, NULL);
+    return err;
+}
+
+int sgd_render_set(sgd_file *f, int index, int crop, uint8_t *buf)
+{
+    if (f->scanned) {
+        snprintf(last_error, sizeof(last_error), "File opened for scanning only");
+        return -EINVAL;
+    }
+
+    if (index < 0 || index >= f->num_groups) {
+        snprintf(last_error, sizeof(last_error), "Bad selection set index");
+        return -EINVAL;
+    }
+
+    render_set_t rs = { index, crop, buf };
+    int err = run_protected(f, render_set, &rs);
+    if (err)
+        run_protected(f, abort_convert, NULL);
+    return err;
+}
+
+int sgd_convert(sgd_file *f, const char *name, const sgd_sink *sink)
+{
+    if (f->scanned) {
+        snprintf(last_error, sizeof(last_error), "File opened for scanning only");
+        return -EINVAL;
+    }
+
+    f->sink = sink;
+    int err = run_protected(f, convert, (void *)name);
+    if (err)
+        run_protected(f, abort_convert, NULL);
+    f->sink = NULL;
+    return err;
 }
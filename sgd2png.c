@@ -0,0 +1,1345 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <ctype.h>
+
+#include <pthread.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#endif
+
+#include "libsgd.h"
+#include "aio.h"
+#include "archive.h"
+#include "watch.h"
+
+__attribute__((__format__(printf, 1, 2)))
+__attribute__((__noreturn__))
+static void panic(const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+
+    fputc('\n', stderr);
+    exit(1);
+}
+
+__attribute__((__format__(printf, 3, 4)))
+static int s_snprintf(char *buf, size_t size, const char *fmt, ...)
+{
+    va_list ap;
+    int ret;
+
+    va_start(ap, fmt);
+    ret = vsnprintf(buf, size, fmt, ap);
+    va_end(ap);
+
+    if (ret < 0 || ret >= size)
+        panic("Buffer too small");
+
+    return ret;
+}
+
+static char *fixsep(char *s)
+{
+#ifdef _WIN32
+    char *p = s;
+
+    while (*p) {
+        if (*p == '\\')
+            *p = '/';
+        p++;
+    }
+#endif
+    return s;
+}
+
+static void mkpath(char *s)
+{
+    char *p = s;
+
+    while (*p == '/')
+        p++;
+
+    while ((p = strchr(p, '/'))) {
+        *p = 0;
+#ifdef _WIN32
+        _mkdir(s);
+#else
+        mkdir(s, 0755);
+#endif
+        *p++ = '/';
+    }
+}
+
+#ifndef _WIN32
+/*
+ * Path of file to relative to directory of file from.
+ */
+static char *relative_path(char *buf, size_t size, const char *to, const char *from)
+{
+    size_t common = 0;
+    for (size_t i = 0; to[i] && to[i] == from[i]; i++)
+        if (to[i] == '/')
+            common = i + 1;
+
+    char *p = buf;
+    for (const char *s = from + common; (s = strchr(s, '/')); s++)
+        p += s_snprintf(p, size - (p - buf), "../");
+    s_snprintf(p, size - (p - buf), "%s", to + common);
+
+    return buf;
+}
+#endif
+
+enum {
+    DUP_COPY,
+    DUP_LINK,
+    DUP_SYMLINK
+};
+
+static int dup_mode = DUP_COPY;
+
+static char *dest_dir = ".";
+
+static int queue_depth = 4;
+
+static int verbose;
+
+static void put_json_string(FILE *fp, const char *s)
+{
+    fputc('"', fp);
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\')
+            fprintf(fp, "\\%c", c);
+        else if (c < ' ')
+            fprintf(fp, "\\u%04x", c);
+        else
+            fputc(c, fp);
+    }
+    fputc('"', fp);
+}
+
+/*
+ * Failures of single files don't stop the batch. Each is printed, and
+ * with -e also written as a line of JSON, giving the stage it failed in.
+ */
+static FILE *error_file;
+static int failures;
+static pthread_mutex_t error_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void report_error(const char *path, const char *stage, int err, const char *msg)
+{
+    pthread_mutex_lock(&error_lock);
+    fprintf(stderr, "%s: %s\n", path, msg);
+    if (error_file) {
+        fprintf(error_file, "{\"file\":");
+        put_json_string(error_file, path);
+        fprintf(error_file, ",\"stage\":\"%s\",\"errno\":%d,\"error\":", stage, err);
+        put_json_string(error_file, msg);
+        fprintf(error_file, "}\n");
+        fflush(error_file);
+    }
+    failures++;
+    pthread_mutex_unlock(&error_lock);
+}
+
+static void write_error(const char *path, int err)
+{
+    report_error(path, "write", err, strerror(err));
+}
+
+/*
+ * Directory made by the last write, and whether writes were queued since
+ * the last sync. Files converted at the same time share these.
+ */
+static char made_dir[1024];
+static bool unsynced;
+static pthread_mutex_t sink_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int make_dir(const char *name)
+{
+    const char *p = strrchr(name, '/');
+    size_t n = p ? p - name + 1 : 0;
+    if (n >= sizeof(made_dir))
+        return ENAMETOOLONG;
+
+    if (n && (strncmp(made_dir, name, n) || made_dir[n])) {
+        memcpy(made_dir, name, n);
+        made_dir[n] = 0;
+        mkpath(made_dir);
+    }
+
+    return 0;
+}
+
+static int write_file(void *opaque, const char *name, uint8_t *data, size_t size)
+{
+    (void)opaque;
+
+    /* queued under lock, so that a link waiting for it syncs */
+    pthread_mutex_lock(&sink_lock);
+    int err = make_dir(name);
+    if (err) {
+        free(data);
+    } else {
+        aio_write(name, data, size);
+        unsynced = true;
+    }
+    pthread_mutex_unlock(&sink_lock);
+
+    return err;
+}
+
+#ifndef _WIN32
+static int link_file(void *opaque, const char *name, const char *target)
+{
+    (void)opaque;
+
+    pthread_mutex_lock(&sink_lock);
+    int res = make_dir(name);
+    if (res) {
+        pthread_mutex_unlock(&sink_lock);
+        return res;
+    }
+
+    if (dup_mode == DUP_LINK) {
+        /* linked file must exist, so this is deferred until writes finish */
+        if (unsynced) {
+            aio_sync();
+            unsynced = false;
+        }
+        unlink(name);
+        res = link(target, name);
+    } else {
+        char buf[1024];
+        unlink(name);
+        res = symlink(relative_path(buf, sizeof(buf), target, name), name);
+    }
+
+    res = res ? errno : 0;
+    pthread_mutex_unlock(&sink_lock);
+
+    return res;
+}
+#endif
+
+static void log_info(void *opaque, const char *msg)
+{
+    if (verbose)
+        fprintf(stderr, "%s: %s\n", (const char *)opaque, msg);
+}
+
+/*
+ * Print one line of JSON describing image size and selection set groups
+ * of file. No tiles are decoded and nothing is rendered.
+ */
+static void write_index(sgd_file *f, const char *path)
+{
+    int width, height;
+    sgd_get_size(f, &width, &height);
+
+    printf("{\"file\":");
+    put_json_string(stdout, path);
+    printf(",\"width\":%d,\"height\":%d,\"sets\":[", width, height);
+
+    for (int i = 0; i < sgd_num_sets(f); i++) {
+        sgd_set_info set;
+        sgd_get_set(f, i, &set);
+
+        printf("%s{\"name\":\"%s\",\"members\":%d,\"entries\":%d,\"bounds\":",
+               i ? "," : "", set.name, set.num_members, set.num_entries);
+        if (set.x0 == set.x1)
+            printf("null");
+        else
+            printf("[%d,%d,%d,%d]", set.x0, set.y0, set.x1, set.y1);
+        printf(",\"set_bounds\":");
+        if (set.set_x0 == set.set_x1)
+            printf("null}");
+        else
+            printf("[%d,%d,%d,%d]}", set.set_x0, set.set_y0, set.set_x1, set.set_y1);
+    }
+
+    printf("]}\n");
+}
+
+static sgd_sink sink = { .write = write_file };
+
+/*
+ * Conversions run at once are limited in number, and in memory estimated
+ * for them when a budget is set. One that exceeds the budget by itself
+ * runs alone.
+ */
+static int max_files = 1;
+static size_t max_memory;
+
+static int running;
+static size_t memory_used;
+static pthread_mutex_t run_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t run_cond = PTHREAD_COND_INITIALIZER;
+
+/*
+ * Buffers pooled by libsgd are kept within what the budget leaves over.
+ * Called with run_lock held.
+ */
+static void limit_pool(void)
+{
+    if (max_memory)
+        sgd_set_pool_limit(memory_used < max_memory ? max_memory - memory_used : 0);
+}
+
+/*
+ * With scheduling, inputs are scanned first and converted in order of
+ * estimated time, longest first. Time is estimated from pixels of base
+ * and set images, at rates measured on files converted so far.
+ */
+static int do_schedule;
+
+/*
+ * Input file, or member of an archive file, named archive:member in
+ * messages. Output is named after the last part of the file or member.
+ * Inputs that can't be scanned, or were converted before when watching,
+ * are skipped.
+ */
+typedef struct {
+    const char  *path;
+    const char  *file;
+    const char  *name;
+    const arc_member *member;
+    const char  *key;
+    double      base_pixels;
+    double      set_pixels;
+    bool        skip;
+} input_t;
+
+static input_t *inputs;
+static int num_inputs;
+static int max_inputs;
+
+static arc_member **archives;
+static int *archive_sizes;
+static int num_archives;
+
+/* archive members to convert, by name or by path within the archive */
+static const char **member_patterns;
+static int num_member_patterns;
+
+/* rates start from a guess of 10 ns per pixel, weighted as 10^8 pixels */
+static double base_time = 1, base_pixels = 1e8;
+static double set_time = 1, set_pixels = 1e8;
+
+static double estimate_time(const input_t *in)
+{
+    return in->base_pixels * base_time / base_pixels + in->set_pixels * set_time / set_pixels;
+}
+
+/*
+ * Inputs are picked in order, or with scheduling from a list of those left
+ * sorted by estimated time, longest last. The list is sorted again as
+ * inputs are added, and once rates changed when a 64th of it was picked
+ * since, so that picking stays cheap for big batches.
+ */
+typedef struct {
+    double      time;
+    int         input;
+} pick_t;
+
+static int next_input;
+static pick_t *picks;
+static int num_picks;
+static int picks_added;
+static int picks_since_sort;
+static bool rates_changed;
+
+static int compare_picks(const void *a, const void *b)
+{
+    const pick_t *p = a, *q = b;
+
+    if (p->time != q->time)
+        return p->time < q->time ? -1 : 1;
+    return q->input - p->input;
+}
+
+/*
+ * Called with run_lock held.
+ */
+static void sort_picks(void)
+{
+    if (!(picks = realloc(picks, (num_picks + num_inputs - picks_added + 1) * sizeof(pick_t))))
+        panic("Out of memory");
+    for (; picks_added < num_inputs; picks_added++)
+        picks[num_picks++].input = picks_added;
+
+    for (int i = 0; i < num_picks; i++)
+        picks[i].time = estimate_time(&inputs[picks[i].input]);
+    qsort(picks, num_picks, sizeof(pick_t), compare_picks);
+
+    picks_since_sort = 0;
+    rates_changed = false;
+}
+
+/*
+ * Next input to convert, or -1 when none is left. Ties keep command line
+ * order.
+ */
+static int pick_input(void)
+{
+    int best = -1;
+
+    pthread_mutex_lock(&run_lock);
+    if (!do_schedule) {
+        if (next_input < num_inputs)
+            best = next_input++;
+    } else {
+        if (picks_added < num_inputs || (rates_changed && picks_since_sort >= num_picks / 64))
+            sort_picks();
+        if (num_picks) {
+            best = picks[--num_picks].input;
+            picks_since_sort++;
+        }
+    }
+    pthread_mutex_unlock(&run_lock);
+
+    return best;
+}
+
+/*
+ * When watching, each converted input is recorded in a journal as a line
+ * of size, modification time and path, which is its key. Inputs whose key
+ * was seen before, or is in the journal, are skipped, so that a restart
+ * doesn't convert them again. A key is recorded once the images of its
+ * input are written, and only if no failure was reported since its
+ * conversion started.
+ */
+typedef struct {
+    const char  *key;
+    int         failures;
+} converted_t;
+
+static const char *journal_path;
+static FILE *journal;
+
+static char **seen_keys;
+static size_t seen_size;
+static size_t num_seen;
+
+/* converted inputs not recorded yet, under run_lock */
+static converted_t *converted;
+static int num_converted;
+static int max_converted;
+
+typedef struct {
+    sgd_file    *f;
+    char        *path;
+    const char  *key;
+    int         failures;
+    char        name[1024];
+    size_t      estimate;
+    double      time;
+} conversion_t;
+
+static void *convert_file(void *arg)
+{
+    conversion_t *c = arg;
+    sgd_stats st;
+
+    int err = sgd_convert(c->f, c->name, &sink);
+    if (err)
+        report_error(c->path, "convert", -err, sgd_last_error());
+    sgd_get_stats(c->f, &st);
+    sgd_close(c->f);
+
+    if (verbose && do_schedule && !err)
+        fprintf(stderr, "%s: %.2f s estimated, %.2f s taken\n", c->path, c->time, st.base_time + st.set_time);
+
+    pthread_mutex_lock(&run_lock);
+    running--;
+    memory_used -= c->estimate;
+    limit_pool();
+    /* times of a failed conversion don't match its pixels */
+    if (!err) {
+        base_time += st.base_time;
+        base_pixels += st.base_pixels;
+        set_time += st.set_time;
+        set_pixels += st.set_pixels;
+        rates_changed = true;
+    }
+    if (!err && c->key) {
+        if (num_converted == max_converted) {
+            max_converted = max_converted ? 2 * max_converted : 64;
+            if (!(converted = realloc(converted, max_converted * sizeof(converted_t))))
+                panic("Out of memory");
+        }
+        converted[num_converted++] = (converted_t){ c->key, c->failures };
+    }
+    pthread_cond_broadcast(&run_cond);
+    pthread_mutex_unlock(&run_lock);
+
+    free(c->path);
+    free(c);
+    return NULL;
+}
+
+static void start_conversion(conversion_t *c)
+{
+    pthread_mutex_lock(&run_lock);
+    while (running == max_files ||
+           (running && max_memory && memory_used + c->estimate > max_memory))
+        pthread_cond_wait(&run_cond, &run_lock);
+    running++;
+    memory_used += c->estimate;
+    limit_pool();
+    pthread_mutex_unlock(&run_lock);
+
+    if (max_files == 1) {
+        convert_file(c);
+        return;
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, convert_file, c))
+        panic("Couldn't start thread");
+    pthread_detach(thread);
+}
+
+static void wait_conversions(void)
+{
+    pthread_mutex_lock(&run_lock);
+    while (running)
+        pthread_cond_wait(&run_cond, &run_lock);
+    pthread_mutex_unlock(&run_lock);
+}
+
+static aio_req *start_read(const input_t *in, size_t max_size)
+{
+    const arc_member *m = in->member;
+
+    if (!m)
+        return aio_read(in->file, max_size, SGD_SLACK);
+
+    /* members too big when extracted fail without reading */
+    return aio_read_range(in->file, m->offset, m->size, m->length > max_size ? 0 : m->size, SGD_SLACK);
+}
+
+static const char *read_error(int err)
+{
+    switch (err) {
+    case EFBIG:
+        return "SGD file too big";
+    case EINVAL:
+        return "Bad archive member";
+    case ENOTSUP:
+        return "Unsupported compression or encryption";
+    default:
+        return strerror(err);
+    }
+}
+
+/*
+ * Returns NULL if file can't be read or parsed, which is reported. Path
+ * names input in messages, and must stay valid while the file is open.
+ */
+static sgd_file *open_file(aio_req *req, const input_t *in, const char *path, sgd_options *opt)
+{
+    uint8_t *data;
+    size_t len;
+    int err = aio_read_wait(req, &data, &len);
+    if (!err && in->member)
+        err = arc_extract(in->member, &data, &len, opt->max_size, SGD_SLACK);
+    if (err) {
+        report_error(path, "read", err, read_error(err));
+        return NULL;
+    }
+
+    sgd_file *f;
+    opt->log_opaque = (void *)path;
+    err = sgd_open_owned(&f, data, len, opt);
+    if (err) {
+        report_error(path, "open", -err, sgd_last_error());
+        return NULL;
+    }
+
+    return f;
+}
+
+/*
+ * Open input for scanning, reading only what describes its sets. Zip
+ * members that are compressed are read whole. Returns NULL if that
+ * fails, which is reported.
+ */
+static sgd_file *scan_file(const input_t *in, sgd_options *opt)
+{
+    const arc_member *m = in->member;
+    uint64_t offset = 0, size;
+    int err = 0;
+
+    if (m) {
+        err = arc_stored_offset(in->file, m, &offset);
+        if (err == ENOTSUP)
+            return open_file(start_read(in, opt->max_size), in, in->path, opt);
+        if (!err && m->length > opt->max_size)
+            err = EFBIG;
+        size = m->length;
+    } else {
+        struct stat st;
+        err = stat(in->file, &st) ? errno : 0;
+        size = st.st_size;
+    }
+    if (err) {
+        report_error(in->path, "read", err, read_error(err));
+        return NULL;
+    }
+
+    sgd_file *f;
+    opt->log_opaque = (void *)in->path;
+    err = sgd_scan_path(&f, in->file, offset, size, opt);
+    if (err) {
+        report_error(in->path, "open", -err, sgd_last_error());
+        return NULL;
+    }
+
+    return f;
+}
+
+/*
+ * Scan headers, directories and entries of all inputs for their amount
+ * of work, as in index mode. Image data is neither read nor decoded.
+ */
+static void scan_files(sgd_options *opt)
+{
+    for (int i = 0; i < num_inputs; i++) {
+        if (inputs[i].skip)
+            continue;
+
+        sgd_file *f = scan_file(&inputs[i], opt);
+        if (!f) {
+            inputs[i].skip = true;
+            continue;
+        }
+
+        sgd_stats st;
+        sgd_get_stats(f, &st);
+        inputs[i].base_pixels = st.base_pixels;
+        inputs[i].set_pixels = st.set_pixels;
+        sgd_close(f);
+    }
+}
+
+/*
+ * Match name against pattern with * and ? wildcards, ignoring case.
+ */
+static bool match_name(const char *pat, const char *name)
+{
+    for (; *pat; pat++, name++) {
+        if (*pat == '*') {
+            for (const char *p = name; ; p++) {
+                if (match_name(pat + 1, p))
+                    return true;
+                if (!*p)
+                    return false;
+            }
+        }
+        if (!*name || (*pat != '?' && toupper((unsigned char)*pat) != toupper((unsigned char)*name)))
+            return false;
+    }
+    return !*name;
+}
+
+static const char *base_name(const char *path)
+{
+    const char *p = strrchr(path, '/');
+    return p ? p + 1 : path;
+}
+
+/*
+ * Patterns without / match the last part of member names.
+ */
+static bool member_selected(const char *name)
+{
+    if (!num_member_patterns)
+        return true;
+    for (int i = 0; i < num_member_patterns; i++) {
+        const char *pat = member_patterns[i];
+        if (match_name(pat, strchr(pat, '/') ? name : base_name(name)))
+            return true;
+    }
+    return false;
+}
+
+static input_t *add_input(const char *path, const char *file, const char *name)
+{
+    if (num_inputs == max_inputs) {
+        max_inputs = max_inputs ? 2 * max_inputs : 256;
+        if (!(inputs = realloc(inputs, max_inputs * sizeof(input_t))))
+            panic("Out of memory");
+    }
+    input_t *in = &inputs[num_inputs++];
+    *in = (input_t){ .path = path, .file = file, .name = base_name(name) };
+    return in;
+}
+
+/*
+ * Add files to inputs, listing members of archives, which are read as
+ * stored without extracting them.
+ */
+static void add_inputs(int argc, char **argv)
+{
+    for (int i = 0; i < argc; i++) {
+        const char *path = fixsep(argv[i]);
+        if (!arc_is_archive(path)) {
+            add_input(path, path, path);
+            continue;
+        }
+
+        arc_member *members;
+        int num_members;
+        int err = arc_list(path, &members, &num_members);
+        if (err) {
+            report_error(path, "read", err, err == EINVAL ? "Bad tar or zip archive" : strerror(err));
+            continue;
+        }
+
+        archives = realloc(archives, (num_archives + 1) * sizeof(arc_member *));
+        archive_sizes = realloc(archive_sizes, (num_archives + 1) * sizeof(int));
+        if (!archives || !archive_sizes)
+            panic("Out of memory");
+        archives[num_archives] = members;
+        archive_sizes[num_archives++] = num_members;
+
+        for (int k = 0; k < num_members; k++) {
+            arc_member *m = &members[k];
+            if (!member_selected(m->name))
+                continue;
+            char *s = malloc(strlen(path) + strlen(m->name) + 2);
+            if (!s)
+                panic("Out of memory");
+            sprintf(s, "%s:%s", path, m->name);
+            add_input(s, path, m->name)->member = m;
+        }
+    }
+}
+
+static void free_inputs(void)
+{
+    for (int i = 0; i < num_inputs; i++)
+        if (inputs[i].member)
+            free((char *)inputs[i].path);
+    free(inputs);
+
+    for (int i = 0; i < num_archives; i++)
+        arc_free(archives[i], archive_sizes[i]);
+    free(archives);
+    free(archive_sizes);
+
+    inputs = NULL;
+    num_inputs = max_inputs = 0;
+    free(picks);
+    picks = NULL;
+    next_input = num_picks = picks_added = 0;
+    archives = NULL;
+    archive_sizes = NULL;
+    num_archives = 0;
+}
+
+/*
+ * Start converting all inputs. Conversions may still be running on return.
+ */
+static void convert_inputs(sgd_options *opt, bool do_index)
+{
+    aio_req **reqs = calloc(num_inputs + 1, sizeof(aio_req *));
+    int *order = calloc(num_inputs + 1, sizeof(int));
+    if (!reqs || !order)
+        panic("Out of memory");
+
+    if (do_schedule && !do_index)
+        scan_files(opt);
+
+    /* inputs are picked, and read ahead, in order of conversion */
+    for (int n = 0, next = 0; n < num_inputs; n++) {
+        for (int k; next < num_inputs && next <= n + queue_depth && (k = pick_input()) >= 0; next++) {
+            order[next] = k;
+            if (!inputs[k].skip)
+                reqs[k] = start_read(&inputs[k], opt->max_size);
+        }
+
+        int i = order[n];
+        if (inputs[i].skip)
+            continue;
+
+        /* conversions name their input on their own, as inputs may be released first */
+        char *path = strdup(inputs[i].path);
+        if (!path)
+            panic("Out of memory");
+
+        sgd_file *f = open_file(reqs[i], &inputs[i], path, opt);
+        if (!f) {
+            free(path);
+            continue;
+        }
+
+        if (do_index) {
+            write_index(f, path);
+            sgd_close(f);
+            free(path);
+            continue;
+        }
+
+        conversion_t *c = malloc(sizeof(*c));
+        if (!c)
+            panic("Out of memory");
+        c->f = f;
+        c->path = path;
+        c->estimate = sgd_estimate_memory(f);
+        pthread_mutex_lock(&run_lock);
+        c->time = estimate_time(&inputs[i]);
+        pthread_mutex_unlock(&run_lock);
+        c->key = inputs[i].key;
+        pthread_mutex_lock(&error_lock);
+        c->failures = failures;
+        pthread_mutex_unlock(&error_lock);
+
+        const char *s = inputs[i].name;
+        char *p, *buf = c->name;
+        int len = snprintf(buf, sizeof(c->name), "%s/%s", dest_dir, s);
+        if (len < 0 || len >= sizeof(c->name)) {
+            report_error(c->path, "convert", ENAMETOOLONG, "Output path too long");
+            sgd_close(f);
+            free(path);
+            free(c);
+            continue;
+        }
+
+        if (strlen(s) >= 3)
+            for (p = buf; (p = strstr(p, "###")); p += 3)
+                memcpy(p, s, 3);
+
+        p = strrchr(buf, '/');
+        if ((p = strrchr(p + 1, '.')))
+            *p = 0;
+
+        start_conversion(c);
+    }
+
+    free(order);
+    free(reqs);
+}
+
+static void process_files(int argc, char **argv, sgd_options *opt, bool do_index)
+{
+    add_inputs(argc, argv);
+    convert_inputs(opt, do_index);
+    wait_conversions();
+    free_inputs();
+}
+
+static size_t key_slot(char **keys, size_t size, const char *key)
+{
+    uint64_t h = 14695981039346656037u;
+    for (const char *p = key; *p; p++)
+        h = (h ^ (uint8_t)*p) * 1099511628211u;
+
+    size_t i = h & (size - 1);
+    while (keys[i] && strcmp(keys[i], key))
+        i = (i + 1) & (size - 1);
+    return i;
+}
+
+/*
+ * Add copy of key to seen keys, and return it, or NULL if it was seen
+ * before.
+ */
+static const char *add_key(const char *key)
+{
+    if (2 * (num_seen + 1) > seen_size) {
+        size_t size = seen_size ? 2 * seen_size : 1024;
+        char **keys = calloc(size, sizeof(char *));
+        if (!keys)
+            panic("Out of memory");
+        for (size_t i = 0; i < seen_size; i++)
+            if (seen_keys[i])
+                keys[key_slot(keys, size, seen_keys[i])] = seen_keys[i];
+        free(seen_keys);
+        seen_keys = keys;
+        seen_size = size;
+    }
+
+    size_t i = key_slot(seen_keys, seen_size, key);
+    if (seen_keys[i])
+        return NULL;
+    if (!(seen_keys[i] = strdup(key)))
+        panic("Out of memory");
+    num_seen++;
+    return seen_keys[i];
+}
+
+static void open_journal(void)
+{
+    char buf[4096];
+    FILE *fp = fopen(journal_path, "r");
+
+    if (fp) {
+        while (fgets(buf, sizeof(buf), fp)) {
+            buf[strcspn(buf, "\n")] = 0;
+            if (*buf)
+                add_key(buf);
+        }
+        fclose(fp);
+    } else if (errno != ENOENT) {
+        panic("Couldn't open %s: %s", journal_path, strerror(errno));
+    }
+
+    if (!(journal = fopen(journal_path, "a")))
+        panic("Couldn't open %s: %s", journal_path, strerror(errno));
+}
+
+/*
+ * Append keys of inputs converted meanwhile to the journal once their
+ * images are written.
+ */
+static void record_converted(void)
+{
+    pthread_mutex_lock(&run_lock);
+    converted_t *list = converted;
+    int n = num_converted;
+    converted = NULL;
+    num_converted = max_converted = 0;
+    pthread_mutex_unlock(&run_lock);
+
+    if (!n)
+        return;
+
+    aio_sync();
+
+    pthread_mutex_lock(&error_lock);
+    int f = failures;
+    pthread_mutex_unlock(&error_lock);
+
+    /* a write that failed may belong to any conversion running meanwhile */
+    for (int i = 0; i < n; i++)
+        if (list[i].failures == f)
+            fprintf(journal, "%s\n", list[i].key);
+    if (fflush(journal))
+        panic("Couldn't write %s: %s", journal_path, strerror(errno));
+
+    free(list);
+}
+
+/*
+ * Skip inputs whose key was seen before, or whose file is gone already.
+ */
+static void key_inputs(void)
+{
+    for (int i = 0; i < num_inputs; i++) {
+        input_t *in = &inputs[i];
+        struct stat st;
+        if (stat(in->file, &st)) {
+            in->skip = true;
+            continue;
+        }
+
+        char *key = malloc(strlen(in->path) + 48);
+        if (!key)
+            panic("Out of memory");
+        sprintf(key, "%lld %lld %s", (long long)st.st_size, (long long)st.st_mtime, in->path);
+        in->key = add_key(key);
+        in->skip = !in->key;
+        free(key);
+    }
+}
+
+/* paths of watched files, kept until their conversions started */
+static char **watched;
+static int num_watched;
+static int max_watched;
+
+static volatile sig_atomic_t stop_watching;
+
+static void stop_watch(int sig)
+{
+    /* a second signal stops right away */
+    signal(sig, SIG_DFL);
+    stop_watching = 1;
+}
+
+static void add_watched(const char *path, void *opaque)
+{
+    (void)opaque;
+
+    const char *name = base_name(path);
+    if (!match_name("*.sgd", name) && !match_name("*.zgd", name) && !arc_is_archive(name))
+        return;
+
+    if (num_watched == max_watched) {
+        max_watched = max_watched ? 2 * max_watched : 256;
+        if (!(watched = realloc(watched, max_watched * sizeof(char *))))
+            panic("Out of memory");
+    }
+    if (!(watched[num_watched++] = strdup(path)))
+        panic("Out of memory");
+}
+
+static void free_watched(void)
+{
+    free_inputs();
+    for (int i = 0; i < num_watched; i++)
+        free(watched[i]);
+    num_watched = 0;
+}
+
+/*
+ * Convert files under directories as they are written, until interrupted.
+ * Conversions started meanwhile are finished and recorded.
+ */
+static void watch_files(int argc, char **argv, sgd_options *opt)
+{
+    open_journal();
+
+    int err = watch_init(argv, argc);
+    if (err)
+        panic("Couldn't watch directories: %s", strerror(err));
+
+    signal(SIGINT, stop_watch);
+    signal(SIGTERM, stop_watch);
+
+    while (!stop_watching) {
+        /* wakes up now and then to record conversions finished meanwhile */
+        err = watch_wait(1000, add_watched, NULL);
+        if (err && err != EINTR)
+            panic("Couldn't watch directories: %s", strerror(err));
+
+        /* once started, conversions need nothing of their inputs */
+        if (num_watched) {
+            add_inputs(num_watched, watched);
+            key_inputs();
+            convert_inputs(opt, false);
+            free_watched();
+        }
+
+        record_converted();
+    }
+
+    wait_conversions();
+    record_converted();
+    free(watched);
+    watch_finish();
+    fclose(journal);
+
+    for (size_t i = 0; i < seen_size; i++)
+        free(seen_keys[i]);
+    free(seen_keys);
+}
+
+static bool is_white(const char *s)
+{
+    while (*s) {
+        if (*s > ' ')
+            return false;
+        s++;
+    }
+    return true;
+}
+
+static const char **set_patterns;
+static int num_set_patterns;
+
+static void add_set_pattern(const char *pat)
+{
+    set_patterns = realloc(set_patterns, (num_set_patterns + 1) * sizeof(char *));
+    if (!set_patterns || !(set_patterns[num_set_patterns++] = strdup(pat)))
+        panic("Out of memory");
+}
+
+static void parse_set_list(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        panic("Couldn't open %s: %s", path, strerror(errno));
+
+    char buf[1024];
+    while (fgets(buf, sizeof(buf), fp)) {
+        char *p = buf + strlen(buf);
+        while (p > buf && (unsigned char)p[-1] <= ' ')
+            *--p = 0;
+        p = buf;
+        while (*p && (unsigned char)*p <= ' ')
+            p++;
+        if (*p)
+            add_set_pattern(p);
+    }
+
+    fclose(fp);
+}
+
+static sgd_color pal[16];
+
+static void parse_pal_file(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        panic("Couldn't open %s: %s", path, strerror(errno));
+
+    int i = 0;
+    int j = 0;
+    char buf[1024];
+    while (fgets(buf, sizeof(buf), fp)) {
+        j++;
+        if (is_white(buf))
+            continue;
+        int r, g, b;
+        if (sscanf(buf, "%x %x %x", &r, &g, &b) != 3)
+            panic("Error at line %d in palette file", j);
+        if (i == 16)
+            panic("Too many colors in palette file");
+        pal[i].r = r;
+        pal[i].g = g;
+        pal[i].b = b;
+        i++;
+    }
+
+    if (i == 8) {
+        for (i = 0; i < 8; i++) {
+            pal[i + 8] = pal[i];
+            pal[i + 8].b = 0;
+        }
+    } else if (i != 16) {
+        panic("Palette file must contain 8 or 16 colors");
+    }
+
+    fclose(fp);
+}
+
+static void print_help(char **argv)
+{
+    fprintf(stderr, "Usage: %s [options] <SGD-file> [...]\n", argv[0]);
+    fprintf(stderr, "       %s [options] -w <file> <directory> [...]\n", argv[0]);
+    fprintf(stderr, "Supported options:\n");
+    fprintf(stderr, "-c         also output cropped pictures of each selection set\n");
+    fprintf(stderr, "-f         also output full pictures of each selection set\n");
+    fprintf(stderr, "-g         also output map of selection set groups as 16 bit PNG\n");
+    fprintf(stderr, "-p <file>  load alternative 8 or 16 color palette from file\n");
+    fprintf(stderr, "-z <0-9>   set PNG compression level\n");
+    fprintf(stderr, "-o <path>  set destination directory\n");
+    fprintf(stderr, "-m <MiB>   set size limit for SGD data and images (default 256)\n");
+    fprintf(stderr, "-s         process image in strips of one tile row to save memory\n");
+    fprintf(stderr, "-q <n>     read ahead and write behind up to n files (default 4)\n");
+    fprintf(stderr, "-v         print statistics for each file\n");
+    fprintf(stderr, "-d <mode>  write duplicate set images as copy (default), link or symlink\n");
+    fprintf(stderr, "-j <n>     render and encode selection sets in n threads (default 1)\n");
+    fprintf(stderr, "-E <n>     encode images in n more threads while rendering goes on\n");
+    fprintf(stderr, "-i         print JSON index of selection sets instead of writing images\n");
+    fprintf(stderr, "-n <name>  only process selection sets matching name, may contain * and ?\n");
+    fprintf(stderr, "-N <file>  only process selection sets matching names listed in file\n");
+    fprintf(stderr, "-b         don't output base picture\n");
+    fprintf(stderr, "-r <n>     also output base picture at 1/2 to 1/2^n scale\n");
+    fprintf(stderr, "-t <size>  output base picture as map tiles of size pixels\n");
+    fprintf(stderr, "-P <n>     convert up to n files at the same time (default 1)\n");
+    fprintf(stderr, "-M <MiB>   start conversions only while their estimated memory fits\n");
+    fprintf(stderr, "-L         scan files first and convert longest running first\n");
+    fprintf(stderr, "-e <file>  write failed files as JSON lines to file\n");
+    fprintf(stderr, "-A <name>  only convert archive members matching name, may contain * and ?\n");
+    fprintf(stderr, "-w <file>  convert files written to directories, recording them in file\n");
+    fprintf(stderr, "-h         show this help message\n");
+    exit(0);
+}
+
+int main(int argc, char **argv)
+{
+    sgd_options sgd_opt;
+    char *pal_file = NULL;
+    char *error_path = NULL;
+    bool do_index = false;
+    int max_mib;
+    int max_mem_mib = 0;
+    int opt;
+
+    sgd_default_options(&sgd_opt);
+    max_mib = sgd_opt.max_size >> 20;
+
+    while ((opt = getopt(argc, argv, "cfgp:z:o:m:sq:vd:j:E:in:N:br:t:P:M:Le:A:w:h")) != -1) {
+        switch (opt) {
+        case 'c':
+            sgd_opt.crop_images = 1;
+            break;
+        case 'f':
+            sgd_opt.full_images = 1;
+            break;
+        case 'g':
+            sgd_opt.set_map = 1;
+            break;
+        case 'p':
+            pal_file = optarg;
+            break;
+        case 'z':
+            sgd_opt.compression = atoi(optarg);
+            break;
+        case 'o':
+            dest_dir = fixsep(optarg);
+            break;
+        case 'm':
+            max_mib = atoi(optarg);
+            break;
+        case 's':
+            sgd_opt.stream = 1;
+            break;
+        case 'q':
+            queue_depth = atoi(optarg);
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        case 'd':
+            if (!strcmp(optarg, "copy"))
+                dup_mode = DUP_COPY;
+#ifndef _WIN32
+            else if (!strcmp(optarg, "link"))
+                dup_mode = DUP_LINK;
+            else if (!strcmp(optarg, "symlink"))
+                dup_mode = DUP_SYMLINK;
+#endif
+            else
+                panic("Bad duplicate mode");
+            break;
+        case 'j':
+            sgd_opt.jobs = atoi(optarg);
+            break;
+        case 'E':
+            sgd_opt.encoders = atoi(optarg);
+            break;
+        case 'i':
+            do_index = true;
+            break;
+        case 'n':
+            add_set_pattern(optarg);
+            break;
+        case 'N':
+            parse_set_list(optarg);
+            break;
+        case 'b':
+            sgd_opt.base_image = 0;
+            break;
+        case 'r':
+            sgd_opt.levels = atoi(optarg);
+            break;
+        case 't':
+            sgd_opt.tile_size = atoi(optarg);
+            break;
+        case 'P':
+            max_files = atoi(optarg);
+            break;
+        case 'M':
+            max_mem_mib = atoi(optarg);
+            break;
+        case 'L':
+            do_schedule = 1;
+            break;
+        case 'e':
+            error_path = optarg;
+            break;
+        case 'A':
+            member_patterns = realloc(member_patterns, (num_member_patterns + 1) * sizeof(char *));
+            if (!member_patterns)
+                panic("Out of memory");
+            member_patterns[num_member_patterns++] = optarg;
+            break;
+        case 'w':
+            journal_path = optarg;
+            break;
+        default:
+            print_help(argv);
+            break;
+        }
+    }
+
+    if (optind >= argc)
+        print_help(argv);
+
+    if (sgd_opt.compression < -1 || sgd_opt.compression > 9)
+        panic("Bad PNG compression level");
+
+    if (max_mib < 1 || max_mib > 2047)
+        panic("Bad size limit");
+    sgd_opt.max_size = (size_t)max_mib << 20;
+
+    if (queue_depth < 0 || queue_depth > 256)
+        panic("Bad queue depth");
+
+    if (sgd_opt.jobs < 1 || sgd_opt.jobs > 256)
+        panic("Bad number of threads");
+
+    if (sgd_opt.encoders < 0 || sgd_opt.encoders > 256)
+        panic("Bad number of encoder threads");
+
+    if (sgd_opt.levels < 0 || sgd_opt.levels > 8)
+        panic("Bad number of reduced levels");
+
+    if (sgd_opt.tile_size && (sgd_opt.tile_size < 16 || sgd_opt.tile_size > 4096))
+        panic("Bad map tile size");
+
+    if (max_files < 1 || max_files > 256)
+        panic("Bad number of files");
+
+    if (max_mem_mib < 0)
+        panic("Bad memory budget");
+    max_memory = (size_t)max_mem_mib << 20;
+
+    if (journal_path && do_index)
+        panic("Can't watch directories for index");
+
+    if (pal_file) {
+        parse_pal_file(pal_file);
+        sgd_opt.palette = pal;
+    }
+
+    if (error_path && !(error_file = fopen(error_path, "w")))
+        panic("Couldn't open %s: %s", error_path, strerror(errno));
+
+    sgd_opt.sets = (const char * const *)set_patterns;
+    sgd_opt.num_sets = num_set_patterns;
+    sgd_opt.log = log_info;
+
+    /* the index needs crops of sets, but no images are made */
+    if (do_index)
+        sgd_opt.crop_images = 1;
+
+#ifndef _WIN32
+    if (dup_mode != DUP_COPY)
+        sink.link = link_file;
+#endif
+
+    aio_init(queue_depth, write_error);
+    atexit(aio_finish);
+
+    if (journal_path)
+        watch_files(argc - optind, argv + optind, &sgd_opt);
+    else
+        process_files(argc - optind, argv + optind, &sgd_opt, do_index);
+
+    aio_finish();
+
+    if (verbose) {
+        sgd_pool_stats ps;
+        sgd_get_pool_stats(&ps);
+        fprintf(stderr, "Buffer pool: %zu of %zu buffers reused (%.0f%%), %.1f MiB held\n",
+                ps.hits, ps.requests, ps.requests ? 100.0 * ps.hits / ps.requests : 0.0,
+                ps.held / 1048576.0);
+    }
+    sgd_free_pool();
+
+    if (error_file)
+        fclose(error_file);
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,355 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+
+#include "watch.h"
+
+#ifdef __linux__
+
+#include <dirent.h>
+#include <poll.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#define DIR_EVENTS  (IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_ONLYDIR)
+
+/*
+ * Files found by scanning may still be written to, so they are reported
+ * once their size and modification time stayed the same for SETTLE_TIME
+ * seconds, checked every CHECK_TIME ms.
+ */
+#define SETTLE_TIME 2.0
+#define CHECK_TIME  500
+
+typedef struct {
+    char        *path;
+    off_t       size;
+    struct timespec mtime;
+    double      since;
+} pending_t;
+
+static int fd = -1;
+
+/* path of each watch descriptor */
+static char **dir_paths;
+static int max_wd;
+
+static char **roots;
+static int num_roots;
+
+/* directories to scan for existing files */
+static char **scans;
+static int num_scans;
+static int max_scans;
+
+static pending_t *pending;
+static int num_pending;
+static int max_pending;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static char *join_path(const char *dir, const char *name)
+{
+    char *s = malloc(strlen(dir) + strlen(name) + 2);
+    if (s)
+        sprintf(s, "%s/%s", dir, name);
+    return s;
+}
+
+/*
+ * Watch directory, or update its path if it is watched already, and
+ * queue it for scanning.
+ */
+static int add_dir(const char *path)
+{
+    int wd = inotify_add_watch(fd, path, DIR_EVENTS);
+    if (wd < 0)
+        return errno;
+
+    if (wd >= max_wd) {
+        int max = max_wd ? max_wd : 64;
+        while (max <= wd)
+            max *= 2;
+        char **p = realloc(dir_paths, max * sizeof(char *));
+        if (!p)
+            return ENOMEM;
+        memset(p + max_wd, 0, (max - max_wd) * sizeof(char *));
+        dir_paths = p;
+        max_wd = max;
+    }
+    free(dir_paths[wd]);
+    if (!(dir_paths[wd] = strdup(path)))
+        return ENOMEM;
+
+    if (num_scans == max_scans) {
+        int max = max_scans ? 2 * max_scans : 64;
+        char **p = realloc(scans, max * sizeof(char *));
+        if (!p)
+            return ENOMEM;
+        scans = p;
+        max_scans = max;
+    }
+    if (!(scans[num_scans] = strdup(path)))
+        return ENOMEM;
+    num_scans++;
+
+    return 0;
+}
+
+static int add_pending(const char *path, const struct stat *st)
+{
+    if (num_pending == max_pending) {
+        int max = max_pending ? 2 * max_pending : 64;
+        pending_t *p = realloc(pending, max * sizeof(pending_t));
+        if (!p)
+            return ENOMEM;
+        pending = p;
+        max_pending = max;
+    }
+
+    char *s = strdup(path);
+    if (!s)
+        return ENOMEM;
+    pending[num_pending++] = (pending_t){ s, st->st_size, st->st_mtim, now() };
+    return 0;
+}
+
+/*
+ * Report pending files that settled, and drop those that are gone.
+ */
+static void check_pending(watch_fn fn, void *opaque)
+{
+    double t = now();
+
+    for (int i = 0; i < num_pending; ) {
+        pending_t *p = &pending[i];
+        struct stat st;
+        bool gone = lstat(p->path, &st) || !S_ISREG(st.st_mode);
+
+        if (!gone && (st.st_size != p->size || st.st_mtim.tv_sec != p->mtime.tv_sec ||
+                      st.st_mtim.tv_nsec != p->mtime.tv_nsec)) {
+            p->size = st.st_size;
+            p->mtime = st.st_mtim;
+            p->since = t;
+        }
+        if (!gone && t - p->since < SETTLE_TIME) {
+            i++;
+            continue;
+        }
+
+        if (!gone)
+            fn(p->path, opaque);
+        free(p->path);
+        *p = pending[--num_pending];
+    }
+}
+
+/*
+ * Queue regular files of queued directories as pending, and watch their
+ * subdirectories in turn. Symbolic links are not followed. Directories
+ * removed meanwhile are skipped.
+ */
+static int run_scans(void)
+{
+    int err = 0;
+
+    while (num_scans && !err) {
+        char *path = scans[--num_scans];
+        DIR *d = opendir(path);
+
+        for (struct dirent *e; d && !err && (e = readdir(d)); ) {
+            if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, ".."))
+                continue;
+
+            char *s = join_path(path, e->d_name);
+            if (!s) {
+                err = ENOMEM;
+                break;
+            }
+
+            struct stat st;
+            if (!lstat(s, &st)) {
+                if (S_ISDIR(st.st_mode))
+                    err = add_dir(s) == ENOMEM ? ENOMEM : 0;
+                else if (S_ISREG(st.st_mode))
+                    err = add_pending(s, &st);
+            }
+            free(s);
+        }
+
+        if (d)
+            closedir(d);
+        free(path);
+    }
+
+    return err;
+}
+
+int watch_init(char **dirs, int num_dirs)
+{
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0)
+        return errno;
+
+    roots = calloc(num_dirs, sizeof(char *));
+    if (!roots)
+        return ENOMEM;
+
+    for (int i = 0; i < num_dirs; i++) {
+        char *s = strdup(dirs[i]);
+        if (!s)
+            return ENOMEM;
+        roots[num_roots++] = s;
+
+        /* no trailing slash, so that it isn't doubled in paths */
+        size_t n = strlen(s);
+        while (n > 1 && s[n - 1] == '/')
+            s[--n] = 0;
+
+        int err = add_dir(s);
+        if (err)
+            return err;
+    }
+
+    return 0;
+}
+
+static int read_events(watch_fn fn, void *opaque)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    for (;;) {
+        ssize_t len = read(fd, buf, sizeof(buf));
+        if (len < 0)
+            return errno == EAGAIN ? 0 : errno;
+
+        const struct inotify_event *ev;
+        for (char *p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+            ev = (const struct inotify_event *)p;
+
+            /* events were dropped, so everything is scanned again */
+            if (ev->mask & IN_Q_OVERFLOW) {
+                for (int i = 0; i < num_roots; i++)
+                    if (add_dir(roots[i]) == ENOMEM)
+                        return ENOMEM;
+                continue;
+            }
+
+            if (ev->wd < 0 || ev->wd >= max_wd || !dir_paths[ev->wd])
+                continue;
+
+            if (ev->mask & IN_IGNORED) {
+                free(dir_paths[ev->wd]);
+                dir_paths[ev->wd] = NULL;
+                continue;
+            }
+
+            if (!ev->len)
+                continue;
+
+            char *s = join_path(dir_paths[ev->wd], ev->name);
+            if (!s)
+                return ENOMEM;
+            if (ev->mask & IN_ISDIR) {
+                if ((ev->mask & (IN_CREATE | IN_MOVED_TO)) && add_dir(s) == ENOMEM) {
+                    free(s);
+                    return ENOMEM;
+                }
+            } else if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+                fn(s, opaque);
+            }
+            free(s);
+        }
+    }
+}
+
+int watch_wait(int timeout, watch_fn fn, void *opaque)
+{
+    int err = run_scans();
+    if (err)
+        return err;
+
+    check_pending(fn, opaque);
+    if (num_pending && timeout > CHECK_TIME)
+        timeout = CHECK_TIME;
+
+    struct pollfd p = { .fd = fd, .events = POLLIN };
+    int n = poll(&p, 1, timeout);
+    if (n < 0)
+        return errno;
+    if (!n)
+        return 0;
+
+    err = read_events(fn, opaque);
+    if (err)
+        return err;
+
+    /* directories created meanwhile may hold files already */
+    return run_scans();
+}
+
+void watch_finish(void)
+{
+    if (fd >= 0)
+        close(fd);
+    fd = -1;
+
+    for (int i = 0; i < max_wd; i++)
+        free(dir_paths[i]);
+    free(dir_paths);
+    dir_paths = NULL;
+    max_wd = 0;
+
+    for (int i = 0; i < num_roots; i++)
+        free(roots[i]);
+    free(roots);
+    roots = NULL;
+    num_roots = 0;
+
+    for (int i = 0; i < num_scans; i++)
+        free(scans[i]);
+    free(scans);
+    scans = NULL;
+    num_scans = max_scans = 0;
+
+    for (int i = 0; i < num_pending; i++)
+        free(pending[i].path);
+    free(pending);
+    pending = NULL;
+    num_pending = max_pending = 0;
+}
+
+#else
+
+int watch_init(char **dirs, int num_dirs)
+{
+    (void)dirs;
+    (void)num_dirs;
+    return ENOSYS;
+}
+
+int watch_wait(int timeout, watch_fn fn, void *opaque)
+{
+    (void)timeout;
+    (void)fn;
+    (void)opaque;
+    return ENOSYS;
+}
+
+void watch_finish(void)
+{
+}
+
+#endif
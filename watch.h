@@ -0,0 +1,28 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+/*
+ * Files under watched directories are reported once they are closed after
+ * writing or moved in. Directories are scanned for existing files when
+ * watching starts, when they are created or moved in, and after events
+ * were lost. Files found so are reported once their size and modification
+ * time stayed the same for two seconds. A file may be reported more than
+ * once.
+ */
+typedef void (*watch_fn)(const char *path, void *opaque);
+
+/*
+ * Start watching directories and their subdirectories. Returns 0 or errno
+ * value, ENOSYS where this is not supported.
+ */
+int watch_init(char **dirs, int num_dirs);
+
+/*
+ * Report files found since the last call to fn, waiting up to timeout ms
+ * for the first. Returns 0, EINTR if interrupted by a signal, or errno.
+ */
+int watch_wait(int timeout, watch_fn fn, void *opaque);
+
+void watch_finish(void);
+
+#endif